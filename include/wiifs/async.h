@@ -0,0 +1,233 @@
+// wiifs
+// Copyright 2018 leoetlino
+// Licensed under GPLv2+
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "wiifs/fs.h"
+#include "wiifs/result.h"
+
+namespace wiifs {
+
+/// Caller-defined value that is passed back in the completion of a request.
+using RequestTag = std::uint64_t;
+
+enum class RequestType {
+  OpenFile,
+  Close,
+  /// Read at the file descriptor's offset (like ReadFile)
+  Read,
+  /// Write at the file descriptor's offset (like WriteFile)
+  Write,
+  ReadAt,
+  WriteAt,
+  Seek,
+  GetFileStatus,
+  CreateFile,
+  CreateDirectory,
+  Delete,
+  Rename,
+  GetMetadata,
+  SetMetadata,
+  /// Only started once every request submitted before it has completed, so that it makes
+  /// their changes durable. Requests submitted after it are not held back.
+  Sync,
+};
+
+enum class RequestPriority {
+  /// Latency-sensitive requests. These are always started before background requests.
+  Interactive,
+  /// Bulk transfers. These only use a limited share of the workers, and large reads and writes
+  /// are split so that interactive requests never have to wait for a whole transfer.
+  Background,
+};
+
+/// An asynchronous file system request. Which fields are used depends on the type;
+/// the helper functions below fill in the right ones.
+struct Request {
+  RequestType type;
+  RequestTag tag = 0;
+  /// File descriptor (for path-based requests: a descriptor returned by OpenFs)
+  Fd fd = 0;
+  /// OpenFile: credentials. SetMetadata: new owner.
+  Uid uid = 0;
+  Gid gid = 0;
+  std::string path;
+  /// Rename: new path
+  std::string new_path;
+  /// OpenFile: access mode. CreateFile, CreateDirectory, SetMetadata: owner access mode.
+  FileMode mode = FileMode::None;
+  FileMode group_mode = FileMode::None;
+  FileMode other_mode = FileMode::None;
+  FileAttribute attribute = 0;
+  /// Read, Write: buffer, which must stay valid until the request has completed
+  std::uint8_t* buffer = nullptr;
+  const std::uint8_t* data = nullptr;
+  std::uint32_t size = 0;
+  /// ReadAt, WriteAt, Seek: file offset
+  std::uint32_t offset = 0;
+  SeekMode seek_mode = SeekMode::Set;
+  RequestPriority priority = RequestPriority::Interactive;
+
+  static Request OpenFile(RequestTag tag, Uid uid, Gid gid, std::string path, FileMode mode) {
+    Request request{RequestType::OpenFile, tag};
+    request.uid = uid;
+    request.gid = gid;
+    request.path = std::move(path);
+    request.mode = mode;
+    return request;
+  }
+  static Request Close(RequestTag tag, Fd fd) { return {RequestType::Close, tag, fd}; }
+  static Request Read(RequestTag tag, Fd fd, std::uint8_t* buffer, std::uint32_t size) {
+    Request request{RequestType::Read, tag, fd};
+    request.buffer = buffer;
+    request.size = size;
+    return request;
+  }
+  static Request Write(RequestTag tag, Fd fd, const std::uint8_t* data, std::uint32_t size) {
+    Request request{RequestType::Write, tag, fd};
+    request.data = data;
+    request.size = size;
+    return request;
+  }
+  static Request ReadAt(RequestTag tag, Fd fd, std::uint32_t offset, std::uint8_t* buffer,
+                        std::uint32_t size) {
+    Request request = Read(tag, fd, buffer, size);
+    request.type = RequestType::ReadAt;
+    request.offset = offset;
+    return request;
+  }
+  static Request WriteAt(RequestTag tag, Fd fd, std::uint32_t offset, const std::uint8_t* data,
+                         std::uint32_t size) {
+    Request request = Write(tag, fd, data, size);
+    request.type = RequestType::WriteAt;
+    request.offset = offset;
+    return request;
+  }
+  static Request Seek(RequestTag tag, Fd fd, std::uint32_t offset, SeekMode mode) {
+    Request request{RequestType::Seek, tag, fd};
+    request.offset = offset;
+    request.seek_mode = mode;
+    return request;
+  }
+  static Request GetFileStatus(RequestTag tag, Fd fd) {
+    return {RequestType::GetFileStatus, tag, fd};
+  }
+  static Request CreateFile(RequestTag tag, Fd fd, std::string path, FileAttribute attribute,
+                            FileMode owner_mode, FileMode group_mode, FileMode other_mode) {
+    Request request{RequestType::CreateFile, tag, fd};
+    request.path = std::move(path);
+    request.attribute = attribute;
+    request.mode = owner_mode;
+    request.group_mode = group_mode;
+    request.other_mode = other_mode;
+    return request;
+  }
+  static Request CreateDirectory(RequestTag tag, Fd fd, std::string path,
+                                 FileAttribute attribute, FileMode owner_mode,
+                                 FileMode group_mode, FileMode other_mode) {
+    Request request = CreateFile(tag, fd, std::move(path), attribute, owner_mode, group_mode,
+                                 other_mode);
+    request.type = RequestType::CreateDirectory;
+    return request;
+  }
+  static Request SetMetadata(RequestTag tag, Fd fd, std::string path, Uid uid, Gid gid,
+                             FileAttribute attribute, FileMode owner_mode, FileMode group_mode,
+                             FileMode other_mode) {
+    Request request = CreateFile(tag, fd, std::move(path), attribute, owner_mode, group_mode,
+                                 other_mode);
+    request.type = RequestType::SetMetadata;
+    request.uid = uid;
+    request.gid = gid;
+    return request;
+  }
+  static Request Delete(RequestTag tag, Fd fd, std::string path) {
+    Request request{RequestType::Delete, tag, fd};
+    request.path = std::move(path);
+    return request;
+  }
+  static Request Rename(RequestTag tag, Fd fd, std::string path, std::string new_path) {
+    Request request = Delete(tag, fd, std::move(path));
+    request.type = RequestType::Rename;
+    request.new_path = std::move(new_path);
+    return request;
+  }
+  static Request GetMetadata(RequestTag tag, Fd fd, std::string path) {
+    Request request = Delete(tag, fd, std::move(path));
+    request.type = RequestType::GetMetadata;
+    return request;
+  }
+  static Request Sync(RequestTag tag) { return {RequestType::Sync, tag}; }
+};
+
+struct Completion {
+  RequestTag tag;
+  RequestType type;
+  ResultCode result;
+  /// OpenFile: file descriptor. Read, Write, ReadAt, WriteAt: number of bytes transferred.
+  /// Seek: new offset.
+  std::uint32_t value = 0;
+  /// GetFileStatus only
+  FileStatus status{};
+  /// GetMetadata only
+  Metadata metadata{};
+};
+
+using CompletionCallback = std::function<void(const Completion& completion)>;
+
+struct AsyncQueueOptions {
+  /// Number of worker threads (0 to pick one based on the number of cores).
+  std::size_t num_threads = 0;
+  /// If set, completions are passed to this callback on the worker thread that processed the
+  /// request instead of being queued for Poll and Wait.
+  CompletionCallback callback;
+  /// Maximum number of workers that may run background requests at the same time
+  /// (0 to use a quarter of the workers). At least one worker is always left for interactive
+  /// requests if there is more than one worker.
+  std::size_t max_background_threads = 0;
+  /// Background reads and writes are done in transfers of at most this many bytes.
+  std::uint32_t background_chunk_size = 0x40000;
+  /// Whether consecutive ReadAt requests of the same priority for nearby ranges of the same
+  /// file are merged into a single read. Merged background reads are also limited to
+  /// `background_chunk_size` bytes.
+  bool merge_reads = true;
+};
+
+/// Executes file system requests on a small, fixed set of worker threads.
+///
+/// Requests for the same file descriptor are executed one at a time, in submission order;
+/// requests for different descriptors may be executed in any order and concurrently.
+/// Syncs are the exception: they wait for all earlier requests, whatever their descriptor.
+/// Among the descriptors that have a request ready to run, those whose next request is
+/// interactive are always served first.
+/// All member functions may be called from several threads at once.
+class AsyncQueue {
+public:
+  virtual ~AsyncQueue() = default;
+
+  /// Create a queue for a file system, which must outlive it. Destroying the queue waits
+  /// for every submitted request to complete.
+  static std::unique_ptr<AsyncQueue> Create(FileSystem& fs,
+                                            const AsyncQueueOptions& options = {});
+
+  virtual void Submit(Request request) = 0;
+  virtual void Submit(std::vector<Request> requests) = 0;
+
+  /// Take up to `max_count` completions without blocking.
+  virtual std::vector<Completion> Poll(std::size_t max_count) = 0;
+  /// Take up to `max_count` completions, blocking until there is at least one
+  /// (unless no request is in flight).
+  virtual std::vector<Completion> Wait(std::size_t max_count) = 0;
+
+  /// Number of requests that have been submitted but have not completed yet.
+  virtual std::size_t GetInFlightCount() const = 0;
+};
+
+}  // namespace wiifs
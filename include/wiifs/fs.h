@@ -7,19 +7,25 @@
 #include <array>
 #include <cstddef>
 #include <cstdint>
+#include <functional>
 #include <memory>
 #include <string>
+#include <string_view>
 #include <vector>
 
 #include "wiifs/result.h"
+#include "wiifs/storage.h"
 
 namespace wiifs {
 
 constexpr size_t NAND_SIZE = 0x21000000;
+static_assert(NAND_SIZE == size_t(NAND_PAGE_SIZE) * NAND_PAGE_COUNT, "Wrong NAND geometry");
 
 using Uid = std::uint32_t;
 using Gid = std::uint16_t;
 using Fd = std::uint32_t;
+/// Identifies a state of the file system metadata. Tokens increase with every change.
+using CommitToken = std::uint64_t;
 
 using FileAttribute = std::uint8_t;
 
@@ -58,6 +64,38 @@ struct Metadata {
   std::uint16_t fst_index;
 };
 
+struct DirectoryEntry {
+  std::string name;
+  Metadata metadata;
+};
+
+/// Called for each child of a directory. The name is only valid for the duration of the call.
+/// The file system is locked while the callback runs, so it must not call back into it.
+using DirectoryCallback = std::function<void(std::string_view name, const Metadata& metadata)>;
+
+enum class WalkAction {
+  /// Keep going (and descend into the entry if it is a directory).
+  Continue,
+  /// Keep going, but do not descend into the entry.
+  SkipChildren,
+  /// End the walk.
+  Stop,
+};
+
+struct WalkEntry {
+  /// Path relative to the root of the walk (e.g. "sys/SYSCONF").
+  /// Only valid for the duration of the visitor call.
+  std::string_view path;
+  Metadata metadata;
+  /// Number of clusters used by the file (0 for directories)
+  std::uint32_t cluster_count;
+  /// Depth relative to the root of the walk (1 for its direct children)
+  std::uint32_t depth;
+};
+
+/// The file system is locked while the visitor runs, so it must not call back into it.
+using WalkVisitor = std::function<WalkAction(const WalkEntry& entry)>;
+
 struct NandStats {
   std::uint32_t cluster_size;
   std::uint32_t free_clusters;
@@ -73,6 +111,162 @@ struct DirectoryStats {
   std::uint32_t used_inodes;
 };
 
+/// A cluster that failed a scrub check.
+struct ScrubError {
+  /// Physical cluster index
+  std::uint16_t cluster;
+  /// FST index of the file that owns the cluster, or 0xffff for superblock clusters
+  std::uint16_t fst_index;
+  /// Index of the cluster in the file (or in the superblock)
+  std::uint16_t chain_index;
+  /// Path of the file that owns the cluster (empty for superblock clusters)
+  std::string path;
+  /// CriticalEccError (uncorrectable ECC error), CheckFailed (HMAC mismatch),
+  /// Invalid (broken cluster chain) or the error that occurred when reading the cluster
+  ResultCode error;
+  /// Index of the superblock (0-15) that the cluster belongs to, for superblock clusters
+  std::uint32_t superblock_slot = 0;
+};
+
+struct ScrubReport {
+  /// Number of clusters that were checked (file data and superblock slots)
+  std::uint32_t checked_clusters = 0;
+  /// Number of single-bit errors that ECC could correct (in the data or in the ECC itself)
+  std::uint32_t ecc_corrected_bits = 0;
+  /// Number of clusters for which only one of the two HMAC copies matches
+  std::uint32_t hmac_copy_mismatches = 0;
+  /// Number of superblock slots that hold a valid superblock
+  std::uint32_t valid_superblocks = 0;
+  /// Number of superblock slots that have never been written
+  std::uint32_t empty_superblocks = 0;
+  std::vector<ScrubError> errors;
+  /// Number of raw bytes read from the NAND
+  std::uint64_t bytes_read = 0;
+  double elapsed_seconds = 0;
+};
+
+/// Called from the scrubbing thread with the number of clusters checked so far and the total.
+/// The file system is locked while the callback runs, so it must not call back into it.
+using ScrubProgressCallback = std::function<void(std::uint32_t done, std::uint32_t total)>;
+
+enum class CheckIssueType {
+  /// A directory or sibling link points to an unused entry or to an entry that has already
+  /// been reached (loop in the FST). Repaired by cutting the link.
+  BadFstLink,
+  /// An entry is in use but cannot be reached from the root directory.
+  /// Repaired by releasing the entry; its clusters are then reclaimed as orphans.
+  UnreachableEntry,
+  /// A file's cluster chain ends before the file size is reached or runs into a cluster
+  /// that is free, reserved or bad. Not repaired; the clusters that the rest of the chain
+  /// still links to are kept rather than reclaimed as orphans.
+  BrokenChain,
+  /// A cluster is used by more than one file, or twice by the same file. Not repaired, and
+  /// like for broken chains, the rest of the chain is kept.
+  CrossLinkedCluster,
+  /// A file's cluster chain is longer than its size requires. Repaired by truncating the chain.
+  OverlongChain,
+  /// A cluster is marked as used but does not belong to any file. Repaired by freeing it.
+  OrphanCluster,
+};
+
+struct CheckIssue {
+  CheckIssueType type;
+  /// FST index of the affected entry, or 0xffff for orphan clusters
+  std::uint16_t fst_index;
+  /// Affected cluster, or 0xffff for FST issues
+  std::uint16_t cluster;
+  /// Path of the affected entry (only the name if the entry is unreachable)
+  std::string path;
+  bool repaired;
+};
+
+struct CheckReport {
+  std::uint32_t files = 0;
+  std::uint32_t directories = 0;
+  /// Number of clusters that belong to a reachable file
+  std::uint32_t owned_clusters = 0;
+  /// Number of clusters that were freed by repairs
+  std::uint32_t freed_clusters = 0;
+  std::vector<CheckIssue> issues;
+  double elapsed_seconds = 0;
+};
+
+struct FragmentationReport {
+  /// Number of files that have at least one cluster
+  std::uint32_t files = 0;
+  /// Number of files whose clusters are not physically contiguous
+  std::uint32_t fragmented_files = 0;
+  /// Number of clusters used by files
+  std::uint32_t file_clusters = 0;
+  /// Number of runs of physically contiguous clusters (equal to `files` with no fragmentation)
+  std::uint32_t extents = 0;
+};
+
+struct DefragmentReport {
+  std::uint32_t defragmented_files = 0;
+  std::uint32_t moved_clusters = 0;
+  /// Fragmented files that were left alone because they did not fit in the remaining budget
+  /// or because there was no free run large enough for them
+  std::uint32_t skipped_files = 0;
+  /// Fragmentation after this call
+  FragmentationReport fragmentation;
+};
+
+/// Counters for the work done by a file system since it was created. Counters only ever
+/// increase, so the difference between two snapshots gives the work done in between.
+struct PerfCounters {
+  /// Clusters read from and written to the storage (including superblock clusters)
+  std::uint64_t clusters_read = 0;
+  std::uint64_t clusters_written = 0;
+  /// File data decrypted and encrypted with AES
+  std::uint64_t bytes_decrypted = 0;
+  std::uint64_t bytes_encrypted = 0;
+  /// HMACs computed for data clusters and superblocks, and verifications that failed
+  std::uint64_t hmacs_computed = 0;
+  std::uint64_t hmac_failures = 0;
+  /// Pages for which ECC data was calculated or checked
+  std::uint64_t ecc_computations = 0;
+  /// Superblocks written, and the number of bytes written for them
+  std::uint64_t superblock_flushes = 0;
+  std::uint64_t superblock_bytes_written = 0;
+  /// Lookups in the single-cluster file cache
+  std::uint64_t cache_hits = 0;
+  std::uint64_t cache_misses = 0;
+  /// Searches of the FAT for free clusters
+  std::uint64_t fat_scans = 0;
+  /// Path to FST index resolutions
+  std::uint64_t path_lookups = 0;
+};
+
+/// Format counters as one "name: value" line per counter, for logging.
+std::string FormatPerfCounters(const PerfCounters& counters);
+
+struct LatencyHistogramBucket {
+  /// Range of latencies (inclusive) that fall into this bucket
+  std::uint64_t min_ns;
+  std::uint64_t max_ns;
+  std::uint64_t count;
+};
+
+/// Latency distribution of a FileSystem member function or of an internal phase.
+/// Latencies are bucketed with a relative error of at most 12.5%; percentiles are reported
+/// as the upper bound of the bucket that contains them.
+struct LatencyHistogram {
+  std::string name;
+  std::uint64_t count = 0;
+  std::uint64_t total_ns = 0;
+  std::uint64_t max_ns = 0;
+  std::uint64_t p50_ns = 0;
+  std::uint64_t p90_ns = 0;
+  std::uint64_t p99_ns = 0;
+  std::uint64_t p999_ns = 0;
+  /// Buckets that are not empty, in increasing order
+  std::vector<LatencyHistogramBucket> buckets;
+};
+
+/// Format histograms as a table with one line per operation, for logging.
+std::string FormatLatencyHistograms(const std::vector<LatencyHistogram>& histograms);
+
 struct FileStatus {
   /// Current offset in bytes relative to the beginning of the file
   std::uint32_t offset;
@@ -80,15 +274,55 @@ struct FileStatus {
   std::uint32_t size;
 };
 
+/// A file segment for vectored reads.
+struct IoSegment {
+  /// Offset in bytes relative to the beginning of the file
+  std::uint32_t offset;
+  std::uint8_t* ptr;
+  std::uint32_t size;
+};
+
+/// A file segment for vectored writes.
+struct ConstIoSegment {
+  /// Offset in bytes relative to the beginning of the file
+  std::uint32_t offset;
+  const std::uint8_t* ptr;
+  std::uint32_t size;
+};
+
 struct FileSystemKeys {
   std::array<std::uint8_t, 20> hmac;
   std::array<std::uint8_t, 16> aes;
 };
 
+/// Controls when the HMAC of data read from the NAND is checked.
+enum class VerificationPolicy {
+  /// Verify every cluster and the superblock each time they are read.
+  Strict,
+  /// Verify each cluster the first time it is read, then trust it until it is rewritten.
+  Lazy,
+  /// Never verify HMACs. Correct HMACs are still written.
+  /// Only use this for images that are known to be valid.
+  Trusted,
+};
+
+struct FileSystemOptions {
+  VerificationPolicy verification = VerificationPolicy::Strict;
+  /// Commit metadata changes from a background thread instead of writing a new superblock
+  /// in every call that changes metadata. Changes are coalesced and committed at most
+  /// `commit_interval_ms` after they were made, or as soon as `commit_max_changes` changes
+  /// are pending. Use WaitForCommit or Sync to wait until changes are durable.
+  bool async_commit = false;
+  std::uint32_t commit_interval_ms = 100;
+  std::uint32_t commit_max_changes = 64;
+};
+
 /// File descriptor for using FS functions internally
 /// without taking an entry in the FD table.
 constexpr Fd INTERNAL_FD = 0xffffff00;
 
+/// All member functions may be called from several threads at once;
+/// calls are serialised internally.
 class FileSystem {
 public:
   virtual ~FileSystem() = default;
@@ -96,14 +330,41 @@ public:
   /// Initialise a file system.
   /// This takes a pointer to a NAND image which must be at least 0x21000000 bytes long.
   static std::unique_ptr<FileSystem> Create(std::uint8_t* nand_bytes, const FileSystemKeys& keys);
+  /// Initialise a file system that is backed by the specified storage.
+  static std::unique_ptr<FileSystem> Create(std::unique_ptr<Storage> storage,
+                                            const FileSystemKeys& keys,
+                                            const FileSystemOptions& options = {});
+  /// Mount a NAND image without write access. The image is only ever read, so it may be
+  /// a read-only mapping shared with other processes. Calls that would modify the file system
+  /// fail with ResultCode::ReadOnly.
+  static std::unique_ptr<FileSystem> CreateReadOnly(const std::uint8_t* nand_bytes,
+                                                    const FileSystemKeys& keys);
+  static std::unique_ptr<FileSystem> CreateReadOnly(std::unique_ptr<Storage> storage,
+                                                    const FileSystemKeys& keys,
+                                                    const FileSystemOptions& options = {});
 
   /// Format the file system.
   virtual ResultCode Format(Uid uid) = 0;
 
+  /// Make every change that has been written to the NAND so far durable. Only the pages that
+  /// were written since the last sync are flushed. (Independently of this, data clusters are
+  /// always made durable before a superblock that references them is written.) Changes to
+  /// files that are still open are only written to the NAND when they are closed.
+  virtual ResultCode Sync() = 0;
+  /// Get a token that identifies the current state of the metadata.
+  virtual CommitToken GetCommitToken() = 0;
+  /// Block until the state identified by `token` (or a later one) has been committed,
+  /// then make it durable like Sync does.
+  virtual ResultCode WaitForCommit(CommitToken token) = 0;
+
   /// Get a file descriptor for using file system functions.
   virtual Result<Fd> OpenFs(Uid uid, Gid gid) = 0;
   /// Get a file descriptor for using file system functions and accessing a file.
   virtual Result<Fd> OpenFile(Uid uid, Gid gid, const std::string& path, FileMode mode) = 0;
+  /// Same as OpenFile, but takes an FST index (see Metadata::fst_index) instead of a path.
+  /// The index must still refer to a file that is reachable from the root.
+  virtual Result<Fd> OpenFileByIndex(Uid uid, Gid gid, std::uint16_t fst_index,
+                                     FileMode mode) = 0;
 
   /// Close a file descriptor.
   virtual ResultCode Close(Fd fd) = 0;
@@ -114,10 +375,37 @@ public:
   /// Write `size` bytes to the file descriptor.
   /// Returns the number of bytes written.
   virtual Result<std::uint32_t> WriteFile(Fd fd, const std::uint8_t* ptr, std::uint32_t size) = 0;
+  /// Read `size` bytes from the file descriptor, starting at `offset`.
+  /// Unlike ReadFile, this neither uses nor changes the file descriptor's offset.
+  /// Returns the number of bytes read.
+  virtual Result<std::uint32_t> ReadFileAt(Fd fd, std::uint32_t offset, std::uint8_t* ptr,
+                                           std::uint32_t size) = 0;
+  /// Write `size` bytes to the file descriptor, starting at `offset`.
+  /// Unlike WriteFile, this neither uses nor changes the file descriptor's offset.
+  /// Existing data in the range is overwritten and the file grows if the range goes past
+  /// its end, but `offset` itself must not be past the end of the file.
+  /// Returns the number of bytes written.
+  virtual Result<std::uint32_t> WriteFileAt(Fd fd, std::uint32_t offset, const std::uint8_t* ptr,
+                                            std::uint32_t size) = 0;
+  /// Read several segments of a file in one call. Segments are served in offset order
+  /// (not in the order in which they are passed) to make the best use of the file cache.
+  /// Returns the total number of bytes read.
+  virtual Result<std::uint32_t> ReadFileV(Fd fd, const std::vector<IoSegment>& segments) = 0;
+  /// Write several segments of a file in one call. Segments are written in offset order,
+  /// so each segment may extend the file up to the start of the next one.
+  /// Returns the total number of bytes written.
+  virtual Result<std::uint32_t> WriteFileV(Fd fd,
+                                           const std::vector<ConstIoSegment>& segments) = 0;
   /// Reposition the file offset for a file descriptor.
   virtual Result<std::uint32_t> SeekFile(Fd fd, std::uint32_t offset, SeekMode mode) = 0;
   /// Get status for a file descriptor.
   virtual Result<FileStatus> GetFileStatus(Fd fd) = 0;
+  /// Reserve a contiguous run of clusters for the file to grow to `size` bytes. The reserved
+  /// clusters are handed out in order as the file grows, so that large writes do not have to
+  /// search for free clusters and the file ends up physically contiguous. Reservations only
+  /// live in memory; whatever is left is released when the file descriptor is closed.
+  /// Fails with NoFreeSpace if there is no free run large enough.
+  virtual ResultCode Preallocate(Fd fd, std::uint32_t size) = 0;
 
   /// Create a file with the specified path and metadata.
   virtual ResultCode CreateFile(Fd fd, const std::string& path, FileAttribute attribute,
@@ -134,9 +422,26 @@ public:
 
   /// List the children of a directory (non-recursively).
   virtual Result<std::vector<std::string>> ReadDirectory(Fd fd, const std::string& path) = 0;
+  /// List the children of a directory (non-recursively) together with their metadata.
+  /// This is much cheaper than calling GetMetadata for each child.
+  virtual Result<std::vector<DirectoryEntry>> ReadDirectoryPlus(Fd fd,
+                                                                const std::string& path) = 0;
+  /// Same as above, but calls `callback` for each child instead of building a list.
+  virtual ResultCode ReadDirectoryPlus(Fd fd, const std::string& path,
+                                       const DirectoryCallback& callback) = 0;
+
+  /// Same as ReadDirectory, but takes the FST index of a directory instead of a path.
+  virtual Result<std::vector<std::string>> ReadDirectoryByIndex(Fd fd,
+                                                                std::uint16_t fst_index) = 0;
+
+  /// Visit every entry under a directory recursively, depth-first, in a single traversal.
+  /// Directories the caller may not read are visited but not descended into.
+  virtual ResultCode Walk(Fd fd, const std::string& path, const WalkVisitor& visitor) = 0;
 
   /// Get metadata about a file.
   virtual Result<Metadata> GetMetadata(Fd fd, const std::string& path) = 0;
+  /// Same as GetMetadata, but takes an FST index instead of a path.
+  virtual Result<Metadata> GetMetadataByIndex(Fd fd, std::uint16_t fst_index) = 0;
   /// Set metadata for a file.
   virtual ResultCode SetMetadata(Fd fd, const std::string& path, Uid uid, Gid gid,
                                  FileAttribute attribute, FileMode owner_mode, FileMode group_mode,
@@ -146,6 +451,42 @@ public:
   virtual Result<NandStats> GetNandStats(Fd fd) = 0;
   /// Get usage information about a directory (used cluster and inode counts).
   virtual Result<DirectoryStats> GetDirectoryStats(Fd fd, const std::string& path) = 0;
+  /// Get a snapshot of the performance counters. This does not wait for other calls.
+  virtual PerfCounters GetPerfCounters() = 0;
+  /// Get the latency distribution of each member function and of internal phases (cluster
+  /// reads and writes, HMAC computations, superblock flushes and path lookups). Operations that
+  /// have never run are left out. This does not wait for other calls.
+  /// Always empty if wiifs was built without WIIFS_PROFILING.
+  virtual std::vector<LatencyHistogram> GetLatencyHistograms() = 0;
+  /// Start recording the member functions and internal phases that run into a ring buffer
+  /// that holds the last `max_events` events. Fails with ResultCode::Invalid if tracing is
+  /// already active or if wiifs was built without WIIFS_PROFILING.
+  virtual ResultCode StartTracing(std::size_t max_events) = 0;
+  /// Stop tracing and write the recorded events to a file in the Chrome trace_event JSON format
+  /// (which can be opened in chrome://tracing or Perfetto).
+  virtual ResultCode StopTracing(const std::string& path) = 0;
+
+  /// Check the integrity of every cluster that belongs to a file and of every superblock slot:
+  /// ECC for each page and both copies of the HMAC. Clusters are checked in physical order
+  /// by several worker threads. Nothing is written to the NAND. Requires uid 0.
+  /// The progress callback may be empty.
+  virtual Result<ScrubReport> Scrub(Fd fd, const ScrubProgressCallback& progress) = 0;
+
+  /// Check the structure of the file system (FST tree and FAT chains) for inconsistencies
+  /// such as loops, cross-linked or orphan clusters and chains that do not match the file size.
+  /// Only the in-memory metadata is examined, in a single linear pass, so this is cheap enough
+  /// to be run at every mount. If `repair` is set, the issues that can be fixed safely are
+  /// fixed and written with a single superblock flush. Requires uid 0.
+  virtual Result<CheckReport> Check(Fd fd, bool repair) = 0;
+
+  /// Get how fragmented the files on the NAND are.
+  virtual Result<FragmentationReport> GetFragmentationReport(Fd fd) = 0;
+  /// Move the clusters of fragmented files so that each file is physically contiguous, which
+  /// makes sequential reads sequential on the storage as well. At most `max_clusters` clusters
+  /// are moved per call (files that are larger than the remaining budget are skipped), so this
+  /// can be called repeatedly in the background. Changes are committed with a single
+  /// superblock flush. Requires uid 0.
+  virtual Result<DefragmentReport> Defragment(Fd fd, std::uint32_t max_clusters) = 0;
 };
 
 }  // namespace wiifs
@@ -0,0 +1,66 @@
+// wiifs
+// Copyright 2018 leoetlino
+// Licensed under GPLv2+
+
+#pragma once
+
+#include <cstdint>
+
+#include "wiifs/fs.h"
+#include "wiifs/result.h"
+
+namespace wiifs {
+
+/// Range of file sizes. Sizes are drawn from a log-uniform distribution, so that most files
+/// are small and a few are large, like on a real console.
+struct FileSizeRange {
+  std::uint32_t min;
+  std::uint32_t max;
+};
+
+struct GeneratorOptions {
+  /// Seed for the layout and the file contents. The same options and keys always produce
+  /// the same image.
+  std::uint64_t seed = 0;
+  /// Fraction of the clusters that are free after formatting which should be used by files
+  /// (0 to 1). Titles are added until this is reached or `max_titles` have been added.
+  double fill_level = 0.5;
+  std::uint32_t max_titles = 1000;
+  /// Fraction of the titles that are installed channels, with a ticket, a TMD and contents.
+  /// The others only have save data, like disc games.
+  double channel_ratio = 0.3;
+  /// Number of content files of each channel
+  std::uint32_t min_contents = 1;
+  std::uint32_t max_contents = 8;
+  /// Number of files in the data directory of each title
+  std::uint32_t min_save_files = 1;
+  std::uint32_t max_save_files = 4;
+  FileSizeRange content_size{0x4000, 0x1000000};
+  FileSizeRange save_size{0x20, 0x40000};
+  /// Fraction of the files (0 to 1) that are written interleaved with each other one cluster
+  /// at a time, so that their clusters are not physically contiguous.
+  double fragmentation = 0;
+};
+
+struct GeneratorReport {
+  std::uint32_t titles = 0;
+  std::uint32_t files = 0;
+  std::uint32_t directories = 0;
+  /// Total size of the files that were written
+  std::uint64_t bytes_written = 0;
+  NandStats nand_stats{};
+  FragmentationReport fragmentation;
+  double elapsed_seconds = 0;
+};
+
+/// Options for a file system that an image will be generated on: metadata changes are
+/// committed in a single batch instead of writing a superblock for every one of them.
+FileSystemOptions GetGeneratorFileSystemOptions();
+
+/// Format a file system and populate it with a synthetic but realistic tree of titles
+/// (/title, /ticket, /sys/uid.sys and the other system directories) whose files are filled
+/// with deterministic pseudo-random data. The file system is synced before returning.
+/// Generation stops early without an error if the FST or the NAND becomes full.
+Result<GeneratorReport> GenerateImage(FileSystem& fs, const GeneratorOptions& options);
+
+}  // namespace wiifs
@@ -28,6 +28,9 @@ enum class ResultCode {
   FileNotEmpty,
   CheckFailed,
   UnknownError,
+  // Codes that were added later go after UnknownError so that existing values do not change.
+  IoError,
+  ReadOnly,
 };
 
 template <typename T>
@@ -0,0 +1,86 @@
+// wiifs
+// Copyright 2018 leoetlino
+// Licensed under GPLv2+
+
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "wiifs/result.h"
+
+namespace wiifs {
+
+/// Size of a NAND page, including the 64 bytes of spare data (ECC and HMAC).
+constexpr std::uint32_t NAND_PAGE_SIZE = 0x840;
+/// Number of pages in a NAND image.
+constexpr std::uint32_t NAND_PAGE_COUNT = 0x40000;
+
+struct PageRange {
+  std::uint32_t first_page;
+  std::uint32_t count;
+};
+
+struct FileStorageOptions {
+  /// Bypass the host page cache (O_DIRECT). Accesses are aligned to 512-byte sectors.
+  bool direct_io = false;
+  /// Store the image as a sparse file. Discarded clusters are deallocated from the host file
+  /// system (hole punching) and holes read back as erased pages (0xff).
+  bool sparse = false;
+  /// Create the image if it does not exist. An empty file is extended to the size of a NAND
+  /// without allocating any space, so a new image is entirely erased when `sparse` is set.
+  bool create = false;
+  /// Open the image for reading only. Writes fail with ResultCode::ReadOnly.
+  bool read_only = false;
+};
+
+/// Backing store for a NAND image. Data is read and written in whole pages.
+///
+/// Implementations must support concurrent calls as long as they do not touch the same pages:
+/// the file system reads and writes clusters from several worker threads.
+class Storage {
+public:
+  virtual ~Storage() = default;
+
+  /// Read `count` pages starting from `first_page` into `data` (count * NAND_PAGE_SIZE bytes).
+  virtual ResultCode ReadPages(std::uint32_t first_page, std::uint32_t count,
+                               std::uint8_t* data) = 0;
+  /// Write `count` pages starting from `first_page` from `data` (count * NAND_PAGE_SIZE bytes).
+  virtual ResultCode WritePages(std::uint32_t first_page, std::uint32_t count,
+                                const std::uint8_t* data) = 0;
+  /// Make previously written pages durable. Returns once all of the specified ranges
+  /// have reached stable storage.
+  virtual ResultCode Flush(const std::vector<PageRange>& ranges) = 0;
+  /// Indicate that the contents of the specified pages are no longer needed, so that the
+  /// space they occupy can be released. Pages whose space was released read back as erased
+  /// (0xff). The default implementation does nothing.
+  virtual ResultCode Discard(const std::vector<PageRange>& ranges) { return ResultCode::Success; }
+  /// Whether Discard actually releases space.
+  virtual bool CanDiscard() const { return false; }
+
+  /// Use a NAND image that is mapped in memory.
+  /// This takes a pointer to a NAND image which must be at least 0x21000000 bytes long.
+  static std::unique_ptr<Storage> CreateForMemory(std::uint8_t* nand_bytes);
+  /// Use a NAND image that is mapped in memory without write access.
+  /// Writes fail with ResultCode::ReadOnly.
+  static std::unique_ptr<Storage> CreateForReadOnlyMemory(const std::uint8_t* nand_bytes);
+  /// Create an empty (fully erased) NAND that only lives in memory. Memory is allocated
+  /// as pages are written and released when they are discarded.
+  static std::unique_ptr<Storage> CreateInMemory();
+  /// Open a NAND image file, which is then accessed with positioned reads and writes
+  /// (pread/pwrite). Only the pages that are actually used are ever read.
+  static Result<std::unique_ptr<Storage>> OpenFile(const std::string& path,
+                                                   const FileStorageOptions& options = {});
+  /// Layer a private, writable delta over a shared base image, which is never written to.
+  /// Pages that have been written are stored in the delta file (created if it does not exist)
+  /// and all other pages are read from the base.
+  static Result<std::unique_ptr<Storage>> CreateOverlay(std::unique_ptr<Storage> base,
+                                                        const std::string& delta_path);
+  /// Write every page stored in an overlay delta file to `target` (usually the base image
+  /// the delta was created over) and flush them.
+  static ResultCode MergeOverlay(const std::string& delta_path, Storage& target);
+};
+
+}  // namespace wiifs
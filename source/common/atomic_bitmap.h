@@ -0,0 +1,37 @@
+// wiifs
+// Copyright 2018 leoetlino
+// Licensed under GPLv2+
+
+#pragma once
+
+#include <array>
+#include <atomic>
+
+#include "common/common_types.h"
+
+/// A fixed-size bitmap whose bits can be set and cleared from several threads at once.
+template <size_t N>
+class AtomicBitmap final {
+public:
+  bool Test(size_t i) const {
+    return (m_words[i / 64].load(std::memory_order_relaxed) & Mask(i)) != 0;
+  }
+  void Set(size_t i) { m_words[i / 64].fetch_or(Mask(i), std::memory_order_relaxed); }
+  void Clear(size_t i) { m_words[i / 64].fetch_and(~Mask(i), std::memory_order_relaxed); }
+  /// Clear a bit and return its previous value.
+  bool TestAndClear(size_t i) {
+    return (m_words[i / 64].fetch_and(~Mask(i), std::memory_order_relaxed) & Mask(i)) != 0;
+  }
+
+  void ClearAll() {
+    for (auto& word : m_words)
+      word.store(0, std::memory_order_relaxed);
+  }
+
+  static constexpr size_t size() { return N; }
+
+private:
+  static constexpr u64 Mask(size_t i) { return u64(1) << (i % 64); }
+
+  std::array<std::atomic<u64>, (N + 63) / 64> m_words{};
+};
@@ -12,21 +12,29 @@
 namespace crypto {
 
 std::vector<u8> AesDecrypt(const u8* key, u8* iv, const u8* src, size_t size) {
-  mbedtls_aes_context aes_ctx;
   std::vector<u8> buffer(size);
-  mbedtls_aes_setkey_dec(&aes_ctx, key, 128);
-  mbedtls_aes_crypt_cbc(&aes_ctx, MBEDTLS_AES_DECRYPT, size, iv, src, buffer.data());
+  AesDecrypt(key, iv, src, buffer.data(), size);
   return buffer;
 }
 
 std::vector<u8> AesEncrypt(const u8* key, u8* iv, const u8* src, size_t size) {
-  mbedtls_aes_context aes_ctx;
   std::vector<u8> buffer(size);
-  mbedtls_aes_setkey_enc(&aes_ctx, key, 128);
-  mbedtls_aes_crypt_cbc(&aes_ctx, MBEDTLS_AES_ENCRYPT, size, iv, src, buffer.data());
+  AesEncrypt(key, iv, src, buffer.data(), size);
   return buffer;
 }
 
+void AesDecrypt(const u8* key, u8* iv, const u8* src, u8* dest, size_t size) {
+  mbedtls_aes_context aes_ctx;
+  mbedtls_aes_setkey_dec(&aes_ctx, key, 128);
+  mbedtls_aes_crypt_cbc(&aes_ctx, MBEDTLS_AES_DECRYPT, size, iv, src, dest);
+}
+
+void AesEncrypt(const u8* key, u8* iv, const u8* src, u8* dest, size_t size) {
+  mbedtls_aes_context aes_ctx;
+  mbedtls_aes_setkey_enc(&aes_ctx, key, 128);
+  mbedtls_aes_crypt_cbc(&aes_ctx, MBEDTLS_AES_ENCRYPT, size, iv, src, dest);
+}
+
 class BlockMacGenerator::Impl final {
 public:
   explicit Impl(const std::array<u8, 20>& hmac_key) : m_hmac_key{hmac_key} {
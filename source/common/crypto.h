@@ -14,6 +14,9 @@ namespace crypto {
 
 std::vector<u8> AesDecrypt(const u8* key, u8* iv, const u8* src, size_t size);
 std::vector<u8> AesEncrypt(const u8* key, u8* iv, const u8* src, size_t size);
+/// Same as above, but writes to `dest` (which may be equal to `src`) instead of allocating.
+void AesDecrypt(const u8* key, u8* iv, const u8* src, u8* dest, size_t size);
+void AesEncrypt(const u8* key, u8* iv, const u8* src, u8* dest, size_t size);
 
 using Hash = std::array<u8, 20>;
 
@@ -21,6 +21,13 @@ static u8 Parity(u8 x) {
   return y;
 }
 
+static u8 XorBytes(u64 x) {
+  x ^= x >> 32;
+  x ^= x >> 16;
+  x ^= x >> 8;
+  return static_cast<u8>(x);
+}
+
 EccData Calculate(const u8* data) {
   u8 a[12][2];
   u32 a0, a1;
@@ -29,11 +36,28 @@ EccData Calculate(const u8* data) {
   EccData ecc;
 
   for (int k = 0; k < 4; ++k) {
+    // a[3 + j][b] is the XOR of every byte whose index has bit j equal to b.
+    // Bits 3 and above are constant within an aligned group of 8 bytes, so those sums can be
+    // computed 8 bytes at a time; bits 0-2 are then handled using the byte lanes of the total.
     std::memset(a, 0, sizeof(a));
-    for (int i = 0; i < 512; ++i) {
-      x = data[i];
-      for (int j = 0; j < 9; j++)
-        a[3 + j][(i >> j) & 1] ^= x;
+    u64 total = 0;
+    u64 high[6] = {};
+    for (int group = 0; group < 64; ++group) {
+      u64 word;
+      std::memcpy(&word, data + 8 * group, sizeof(word));
+      total ^= word;
+      for (int j = 0; j < 6; j++)
+        high[j] ^= word & (0 - u64((group >> j) & 1));
+    }
+
+    u8 lanes[8];
+    std::memcpy(lanes, &total, sizeof(lanes));
+    for (int i = 0; i < 8; ++i)
+      for (int j = 0; j < 3; j++)
+        a[3 + j][(i >> j) & 1] ^= lanes[i];
+    for (int j = 0; j < 6; j++) {
+      a[6 + j][1] = XorBytes(high[j]);
+      a[6 + j][0] = XorBytes(total) ^ a[6 + j][1];
     }
 
     x = a[3][0] ^ a[3][1];
@@ -64,4 +88,38 @@ EccData Calculate(const u8* data) {
   return ecc;
 }
 
+CorrectionResult Correct(u8* data, const EccData& stored) {
+  CorrectionResult result;
+  const EccData calculated = Calculate(data);
+  for (int k = 0; k < 4; ++k) {
+    // Each 512-byte block has two 12-bit parity words: the first one covers the bytes and bits
+    // whose index has a given bit cleared, the second one those with that bit set.
+    const auto word = [k](const EccData& ecc, int i) {
+      return u32(ecc[4 * k + i]) | u32(ecc[4 * k + i + 1]) << 8;
+    };
+    const u32 syndrome0 = word(stored, 0) ^ word(calculated, 0);
+    const u32 syndrome1 = word(stored, 2) ^ word(calculated, 2);
+    if (syndrome0 == 0 && syndrome1 == 0)
+      continue;
+
+    // A single flipped data bit changes exactly one of the two parities for every index bit,
+    // and the second syndrome is then the position of that bit.
+    if ((syndrome0 ^ syndrome1) == 0xfff) {
+      data[512 * k + (syndrome1 >> 3)] ^= 1 << (syndrome1 & 7);
+      ++result.corrected_bits;
+      continue;
+    }
+
+    // A single flipped bit in the ECC data only changes one parity.
+    const u32 syndrome = syndrome0 | syndrome1 << 16;
+    if ((syndrome & (syndrome - 1)) == 0) {
+      ++result.ecc_bit_errors;
+      continue;
+    }
+
+    result.uncorrectable = true;
+  }
+  return result;
+}
+
 }  // namespace ecc
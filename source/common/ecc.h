@@ -15,4 +15,17 @@ using EccData = std::array<u8, 16>;
 /// Calculate ECC data for 2048 bytes of data.
 EccData Calculate(const u8* data);
 
+struct CorrectionResult {
+  /// Number of bit errors that were corrected in the data.
+  u32 corrected_bits = 0;
+  /// Number of bit errors in the stored ECC data itself (the data is intact).
+  u32 ecc_bit_errors = 0;
+  /// Whether any 512-byte block has more errors than can be corrected.
+  bool uncorrectable = false;
+};
+
+/// Check 2048 bytes of data against the stored ECC data and correct single-bit errors
+/// (one per 512-byte block) in place.
+CorrectionResult Correct(u8* data, const EccData& stored);
+
 }  // namespace ecc
@@ -0,0 +1,43 @@
+// wiifs
+// Copyright 2018 leoetlino
+// Licensed under GPLv2+
+
+#include "common/histogram.h"
+
+namespace {
+
+u32 GetMostSignificantBit(u64 value) {
+#if defined(__GNUC__) || defined(__clang__)
+  return 63 - __builtin_clzll(value);
+#else
+  u32 bit = 0;
+  while (value >>= 1)
+    ++bit;
+  return bit;
+#endif
+}
+
+}  // namespace
+
+u32 AtomicHistogram::GetBucketIndex(u64 value) {
+  // Small values are recorded exactly.
+  if (value < SUB_BUCKETS)
+    return u32(value);
+  const u32 shift = GetMostSignificantBit(value) - SUB_BUCKET_BITS;
+  const u32 sub_bucket = u32(value >> shift) & (SUB_BUCKETS - 1);
+  return (shift + 1) * SUB_BUCKETS + sub_bucket;
+}
+
+u64 AtomicHistogram::GetBucketLowerBound(u32 index) {
+  if (index < SUB_BUCKETS)
+    return index;
+  const u32 shift = index / SUB_BUCKETS - 1;
+  return u64(SUB_BUCKETS + index % SUB_BUCKETS) << shift;
+}
+
+u64 AtomicHistogram::GetBucketUpperBound(u32 index) {
+  if (index < SUB_BUCKETS)
+    return index;
+  const u32 shift = index / SUB_BUCKETS - 1;
+  return GetBucketLowerBound(index) + ((u64(1) << shift) - 1);
+}
@@ -0,0 +1,46 @@
+// wiifs
+// Copyright 2018 leoetlino
+// Licensed under GPLv2+
+
+#pragma once
+
+#include <array>
+#include <atomic>
+
+#include "common/common_types.h"
+
+/// A histogram of u64 values in the style of HdrHistogram: buckets are powers of two that are
+/// each split into 8 linear sub-buckets, so any value is recorded with a relative error of
+/// at most 1/8 using a small, fixed number of buckets. Recording is lock-free.
+class AtomicHistogram final {
+public:
+  static constexpr u32 SUB_BUCKET_BITS = 3;
+  static constexpr u32 SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+  static constexpr u32 NUM_BUCKETS = (64 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+
+  void Record(u64 value) {
+    constexpr auto order = std::memory_order_relaxed;
+    m_buckets[GetBucketIndex(value)].fetch_add(1, order);
+    m_count.fetch_add(1, order);
+    m_total.fetch_add(value, order);
+    u64 max = m_max.load(order);
+    while (value > max && !m_max.compare_exchange_weak(max, value, order)) {
+    }
+  }
+
+  u64 GetCount() const { return m_count.load(std::memory_order_relaxed); }
+  u64 GetTotal() const { return m_total.load(std::memory_order_relaxed); }
+  u64 GetMax() const { return m_max.load(std::memory_order_relaxed); }
+  u64 GetBucketCount(u32 index) const { return m_buckets[index].load(std::memory_order_relaxed); }
+
+  static u32 GetBucketIndex(u64 value);
+  /// Smallest and largest value (inclusive) that are recorded in a bucket.
+  static u64 GetBucketLowerBound(u32 index);
+  static u64 GetBucketUpperBound(u32 index);
+
+private:
+  std::array<std::atomic<u64>, NUM_BUCKETS> m_buckets{};
+  std::atomic<u64> m_count{0};
+  std::atomic<u64> m_total{0};
+  std::atomic<u64> m_max{0};
+};
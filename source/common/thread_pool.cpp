@@ -0,0 +1,95 @@
+// wiifs
+// Copyright 2018 leoetlino
+// Licensed under GPLv2+
+
+#include "common/thread_pool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+
+ThreadPool::ThreadPool(size_t num_threads) {
+  for (size_t i = 0; i < num_threads; ++i)
+    m_threads.emplace_back([this] { WorkerLoop(); });
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock{m_mutex};
+    m_stop = true;
+  }
+  m_cv.notify_all();
+  for (std::thread& thread : m_threads)
+    thread.join();
+}
+
+void ThreadPool::Submit(std::function<void()> task) {
+  {
+    std::lock_guard<std::mutex> lock{m_mutex};
+    m_tasks.emplace_back(std::move(task));
+  }
+  m_cv.notify_one();
+}
+
+void ThreadPool::WorkerLoop() {
+  while (true) {
+    std::function<void()> task;
+    {
+      std::unique_lock<std::mutex> lock{m_mutex};
+      m_cv.wait(lock, [this] { return m_stop || !m_tasks.empty(); });
+      if (m_stop && m_tasks.empty())
+        return;
+      task = std::move(m_tasks.front());
+      m_tasks.pop_front();
+    }
+    task();
+  }
+}
+
+void ThreadPool::ParallelFor(size_t count, const std::function<void(size_t)>& fn) {
+  if (count == 0)
+    return;
+
+  // Helpers may only start running after every item has been claimed (and this function
+  // has returned), so the shared state must outlive the call. fn is only ever dereferenced
+  // after successfully claiming an item, which guarantees that the caller is still waiting.
+  struct State {
+    const std::function<void(size_t)>* fn;
+    size_t count;
+    std::atomic<size_t> next{0};
+    size_t done = 0;
+    std::mutex mutex;
+    std::condition_variable cv;
+  };
+  auto state = std::make_shared<State>();
+  state->fn = &fn;
+  state->count = count;
+
+  const auto run = [](State& s) {
+    size_t processed = 0;
+    for (size_t i = s.next++; i < s.count; i = s.next++) {
+      (*s.fn)(i);
+      ++processed;
+    }
+    if (processed == 0)
+      return;
+    std::lock_guard<std::mutex> lock{s.mutex};
+    s.done += processed;
+    if (s.done == s.count)
+      s.cv.notify_all();
+  };
+
+  const size_t num_helpers = std::min(m_threads.size(), count - 1);
+  for (size_t i = 0; i < num_helpers; ++i)
+    Submit([state, run] { run(*state); });
+
+  run(*state);
+  std::unique_lock<std::mutex> lock{state->mutex};
+  state->cv.wait(lock, [&] { return state->done == state->count; });
+}
+
+size_t GetDefaultWorkerCount() {
+  // The calling thread also takes part in parallel work, hence the - 1.
+  const size_t hardware_threads = std::max(1u, std::thread::hardware_concurrency());
+  return std::clamp<size_t>(hardware_threads - 1, 1, 15);
+}
@@ -0,0 +1,46 @@
+// wiifs
+// Copyright 2018 leoetlino
+// Licensed under GPLv2+
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "common/common_types.h"
+
+/// A fixed-size pool of worker threads.
+class ThreadPool final {
+public:
+  explicit ThreadPool(size_t num_threads);
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  size_t GetThreadCount() const { return m_threads.size(); }
+
+  /// Queue a task for execution on one of the worker threads.
+  void Submit(std::function<void()> task);
+
+  /// Call fn(i) for every i in [0, count) and wait for all calls to return.
+  /// The calling thread takes part in the work, so this never deadlocks even if
+  /// every worker is busy.
+  void ParallelFor(size_t count, const std::function<void(size_t)>& fn);
+
+private:
+  void WorkerLoop();
+
+  std::vector<std::thread> m_threads;
+  std::deque<std::function<void()>> m_tasks;
+  std::mutex m_mutex;
+  std::condition_variable m_cv;
+  bool m_stop = false;
+};
+
+/// Get the default number of worker threads to use for parallel work.
+size_t GetDefaultWorkerCount();
@@ -0,0 +1,436 @@
+// wiifs
+// Copyright 2018 leoetlino
+// Licensed under GPLv2+
+
+#include <algorithm>
+#include <array>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <set>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "common/align.h"
+#include "common/common_types.h"
+#include "common/thread_pool.h"
+#include "driver/sffs.h"
+#include "wiifs/async.h"
+
+namespace wiifs {
+
+namespace {
+
+/// Upper bound for the size of a merged read.
+constexpr u32 MAX_MERGED_READ_SIZE = 0x100000;
+/// Upper bound for the number of requests that are merged into one read.
+constexpr size_t MAX_MERGED_READS = 64;
+
+Completion Execute(FileSystem& fs, const Request& request) {
+  Completion completion{request.tag, request.type, ResultCode::Success};
+  const auto set_value = [&completion](const Result<u32>& result) {
+    if (result)
+      completion.value = *result;
+    else
+      completion.result = result.Error();
+  };
+
+  switch (request.type) {
+  case RequestType::OpenFile:
+    set_value(fs.OpenFile(request.uid, request.gid, request.path, request.mode));
+    break;
+  case RequestType::Close:
+    completion.result = fs.Close(request.fd);
+    break;
+  case RequestType::Read:
+    set_value(fs.ReadFile(request.fd, request.buffer, request.size));
+    break;
+  case RequestType::Write:
+    set_value(fs.WriteFile(request.fd, request.data, request.size));
+    break;
+  case RequestType::ReadAt:
+    set_value(fs.ReadFileAt(request.fd, request.offset, request.buffer, request.size));
+    break;
+  case RequestType::WriteAt:
+    set_value(fs.WriteFileAt(request.fd, request.offset, request.data, request.size));
+    break;
+  case RequestType::Seek:
+    set_value(fs.SeekFile(request.fd, request.offset, request.seek_mode));
+    break;
+  case RequestType::GetFileStatus: {
+    const Result<FileStatus> status = fs.GetFileStatus(request.fd);
+    if (status)
+      completion.status = *status;
+    else
+      completion.result = status.Error();
+    break;
+  }
+  case RequestType::CreateFile:
+    completion.result = fs.CreateFile(request.fd, request.path, request.attribute, request.mode,
+                                      request.group_mode, request.other_mode);
+    break;
+  case RequestType::CreateDirectory:
+    completion.result = fs.CreateDirectory(request.fd, request.path, request.attribute,
+                                           request.mode, request.group_mode, request.other_mode);
+    break;
+  case RequestType::Delete:
+    completion.result = fs.Delete(request.fd, request.path);
+    break;
+  case RequestType::Rename:
+    completion.result = fs.Rename(request.fd, request.path, request.new_path);
+    break;
+  case RequestType::GetMetadata: {
+    const Result<Metadata> metadata = fs.GetMetadata(request.fd, request.path);
+    if (metadata)
+      completion.metadata = *metadata;
+    else
+      completion.result = metadata.Error();
+    break;
+  }
+  case RequestType::SetMetadata:
+    completion.result =
+        fs.SetMetadata(request.fd, request.path, request.uid, request.gid, request.attribute,
+                       request.mode, request.group_mode, request.other_mode);
+    break;
+  case RequestType::Sync:
+    completion.result = fs.Sync();
+    break;
+  default:
+    completion.result = ResultCode::Invalid;
+    break;
+  }
+  return completion;
+}
+
+bool IsTransfer(RequestType type) {
+  return type == RequestType::Read || type == RequestType::Write ||
+         type == RequestType::ReadAt || type == RequestType::WriteAt;
+}
+
+/// Execute a read or a write as a series of smaller transfers. The file system lock is
+/// released between transfers, which lets requests from other workers through.
+Completion ExecuteInChunks(FileSystem& fs, const Request& request, u32 chunk_size) {
+  Request chunk = request;
+  u32 processed = 0;
+  while (true) {
+    chunk.size = std::min(chunk_size, request.size - processed);
+    Completion completion = Execute(fs, chunk);
+    if (completion.result != ResultCode::Success)
+      return completion;
+    processed += completion.value;
+    if (processed == request.size || completion.value != chunk.size) {
+      completion.value = processed;
+      return completion;
+    }
+    chunk.offset += completion.value;
+    chunk.buffer = chunk.buffer ? chunk.buffer + completion.value : nullptr;
+    chunk.data = chunk.data ? chunk.data + completion.value : nullptr;
+  }
+}
+
+/// Execute a request. Background transfers are split into chunks of `chunk_size` bytes.
+Completion ExecuteRequest(FileSystem& fs, const Request& request, u32 chunk_size) {
+  if (request.priority == RequestPriority::Background && IsTransfer(request.type))
+    return ExecuteInChunks(fs, request, chunk_size);
+  return Execute(fs, request);
+}
+
+/// Execute a run of ReadAt requests of the same priority for the same file descriptor.
+/// Requests are sorted by offset and those that touch the same or adjacent clusters are served
+/// by a single read, so that every cluster is only looked up and decrypted once. For background
+/// requests, merged reads are no larger than `chunk_size`, like any other background transfer.
+std::vector<Completion> ExecuteReads(FileSystem& fs, const std::vector<Request>& requests,
+                                     u32 chunk_size) {
+  const u32 max_merged_size = requests.front().priority == RequestPriority::Background ?
+                                  std::min(chunk_size, MAX_MERGED_READ_SIZE) :
+                                  MAX_MERGED_READ_SIZE;
+  std::vector<Completion> completions(requests.size());
+  std::vector<size_t> order(requests.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(),
+                   [&](size_t a, size_t b) { return requests[a].offset < requests[b].offset; });
+
+  std::vector<u8> buffer;
+  for (size_t i = 0, end; i < order.size(); i = end) {
+    const u32 start = requests[order[i]].offset;
+    u64 range_end = u64(start) + requests[order[i]].size;
+    for (end = i + 1; end < order.size(); ++end) {
+      const Request& next = requests[order[end]];
+      const u64 new_end = std::max(range_end, u64(next.offset) + next.size);
+      if (next.offset > AlignUp(range_end, CLUSTER_DATA_SIZE) ||
+          new_end - start > max_merged_size) {
+        break;
+      }
+      range_end = new_end;
+    }
+
+    if (end == i + 1) {
+      completions[order[i]] = ExecuteRequest(fs, requests[order[i]], chunk_size);
+      continue;
+    }
+
+    buffer.resize(range_end - start);
+    const Result<u32> result =
+        fs.ReadFileAt(requests[order[i]].fd, start, buffer.data(), u32(buffer.size()));
+    if (!result) {
+      // The error may come from a cluster that only some of the requests need, and merging
+      // must not change what each request returns, so they are retried one by one.
+      for (size_t j = i; j < end; ++j)
+        completions[order[j]] = ExecuteRequest(fs, requests[order[j]], chunk_size);
+      continue;
+    }
+
+    // A short read means that the file ends at start + *result.
+    const u64 available = u64(start) + *result;
+    const bool hit_end_of_file = *result != buffer.size();
+    for (size_t j = i; j < end; ++j) {
+      const Request& request = requests[order[j]];
+      Completion& completion = completions[order[j]];
+      completion = {request.tag, request.type, ResultCode::Success};
+      if (hit_end_of_file && request.offset > available) {
+        // Same as what ReadFileAt returns for reads that start past the end of the file.
+        completion.result = ResultCode::Invalid;
+      } else {
+        completion.value = u32(std::min<u64>(request.size, available - request.offset));
+        std::memcpy(request.buffer, &buffer[request.offset - start], completion.value);
+      }
+    }
+  }
+  return completions;
+}
+
+class AsyncQueueImpl final : public AsyncQueue {
+public:
+  AsyncQueueImpl(FileSystem& fs, const AsyncQueueOptions& options)
+      : m_fs{fs}, m_options{options} {
+    const size_t num_threads =
+        options.num_threads != 0 ? options.num_threads : GetDefaultWorkerCount();
+    m_max_background = options.max_background_threads != 0 ?
+                           options.max_background_threads :
+                           std::max<size_t>(1, num_threads / 4);
+    if (num_threads > 1)
+      m_max_background = std::min(m_max_background, num_threads - 1);
+    if (m_options.background_chunk_size == 0)
+      m_options.background_chunk_size = CLUSTER_DATA_SIZE;
+
+    for (size_t i = 0; i < num_threads; ++i)
+      m_workers.emplace_back([this] { WorkerLoop(); });
+  }
+
+  ~AsyncQueueImpl() override {
+    {
+      std::unique_lock<std::mutex> lock{m_mutex};
+      m_done_cv.wait(lock, [this] { return m_in_flight == 0; });
+      m_stop = true;
+    }
+    m_work_cv.notify_all();
+    for (std::thread& worker : m_workers)
+      worker.join();
+  }
+
+  void Submit(Request request) override {
+    {
+      std::lock_guard<std::mutex> lock{m_mutex};
+      SubmitLocked(std::move(request));
+    }
+    m_work_cv.notify_one();
+  }
+
+  void Submit(std::vector<Request> requests) override {
+    {
+      std::lock_guard<std::mutex> lock{m_mutex};
+      for (Request& request : requests)
+        SubmitLocked(std::move(request));
+    }
+    m_work_cv.notify_all();
+  }
+
+  std::vector<Completion> Poll(size_t max_count) override {
+    std::lock_guard<std::mutex> lock{m_mutex};
+    return TakeCompletions(max_count);
+  }
+
+  std::vector<Completion> Wait(size_t max_count) override {
+    std::unique_lock<std::mutex> lock{m_mutex};
+    m_done_cv.wait(lock, [this] { return !m_completions.empty() || m_in_flight == 0; });
+    return TakeCompletions(max_count);
+  }
+
+  size_t GetInFlightCount() const override {
+    std::lock_guard<std::mutex> lock{m_mutex};
+    return m_in_flight;
+  }
+
+private:
+  /// Identifies a sequence of requests that must be executed one at a time and in order.
+  /// There is one strand for each file descriptor; requests that do not need to be ordered
+  /// get a strand of their own.
+  using StrandKey = u64;
+
+  struct QueuedRequest {
+    Request request;
+    /// Submission order
+    u64 sequence;
+  };
+
+  void SubmitLocked(Request request) {
+    ++m_in_flight;
+    const u64 sequence = m_next_sequence++;
+    m_pending.insert(sequence);
+
+    // A sync waits for every request that was submitted before it (including earlier syncs),
+    // so that it also covers writes to other descriptors that have not started yet.
+    if (request.type == RequestType::Sync) {
+      m_barriers.push_back({std::move(request), sequence});
+      ReleaseBarriers();
+      return;
+    }
+
+    const StrandKey key = request.type != RequestType::OpenFile ? StrandKey(request.fd) :
+                                                                  NewStrandKey();
+    Enqueue(key, {std::move(request), sequence});
+  }
+
+  StrandKey NewStrandKey() { return (1ull << 32) | m_next_key++; }
+
+  void Enqueue(StrandKey key, QueuedRequest request) {
+    // A strand has an entry in m_strands for as long as it is ready or running.
+    const auto [it, inserted] = m_strands.try_emplace(key);
+    it->second.emplace_back(std::move(request));
+    if (inserted)
+      MakeReady(key);
+  }
+
+  /// Start the oldest sync if every request that was submitted before it has completed.
+  void ReleaseBarriers() {
+    if (!m_barriers.empty() && m_barriers.front().sequence == *m_pending.begin()) {
+      Enqueue(NewStrandKey(), std::move(m_barriers.front()));
+      m_barriers.pop_front();
+    }
+  }
+
+  /// Queue a strand in the ready queue for the priority of its next request.
+  void MakeReady(StrandKey key) {
+    m_ready[size_t(m_strands.at(key).front().request.priority)].push_back(key);
+  }
+
+  std::deque<StrandKey>* GetNextReadyQueue() {
+    auto& interactive = m_ready[size_t(RequestPriority::Interactive)];
+    auto& background = m_ready[size_t(RequestPriority::Background)];
+    if (!interactive.empty())
+      return &interactive;
+    if (!background.empty() && m_running_background < m_max_background)
+      return &background;
+    return nullptr;
+  }
+
+  void WorkerLoop() {
+    std::unique_lock<std::mutex> lock{m_mutex};
+    while (true) {
+      std::deque<StrandKey>* ready = nullptr;
+      m_work_cv.wait(lock, [&] { return m_stop || (ready = GetNextReadyQueue()) != nullptr; });
+      if (!ready)
+        return;
+
+      const StrandKey key = ready->front();
+      ready->pop_front();
+      std::vector<u64> sequences;
+      const std::vector<Request> batch = TakeBatch(key, &sequences);
+      const bool background = batch.front().priority == RequestPriority::Background;
+      m_running_background += background;
+
+      lock.unlock();
+      std::vector<Completion> completions = ExecuteBatch(batch);
+      if (m_options.callback) {
+        for (const Completion& completion : completions)
+          m_options.callback(completion);
+      }
+      lock.lock();
+
+      m_running_background -= background;
+      if (!m_options.callback)
+        std::move(completions.begin(), completions.end(), std::back_inserter(m_completions));
+      m_in_flight -= batch.size();
+      for (const u64 sequence : sequences)
+        m_pending.erase(sequence);
+      ReleaseBarriers();
+      const auto it = m_strands.find(key);
+      if (it->second.empty())
+        m_strands.erase(it);
+      else
+        MakeReady(key);
+      m_done_cv.notify_all();
+      // The strand may have more work, or a background slot may have been freed.
+      m_work_cv.notify_all();
+    }
+  }
+
+  /// Take the next requests from a strand: either a single request, or a run of ReadAt
+  /// requests with the same priority if reads are merged.
+  std::vector<Request> TakeBatch(StrandKey key, std::vector<u64>* sequences) {
+    std::deque<QueuedRequest>& queue = m_strands.at(key);
+    std::vector<Request> batch;
+    do {
+      batch.emplace_back(std::move(queue.front().request));
+      sequences->push_back(queue.front().sequence);
+      queue.pop_front();
+    } while (m_options.merge_reads && batch.front().type == RequestType::ReadAt &&
+             !queue.empty() && queue.front().request.type == RequestType::ReadAt &&
+             queue.front().request.priority == batch.front().priority &&
+             batch.size() < MAX_MERGED_READS);
+    return batch;
+  }
+
+  std::vector<Completion> ExecuteBatch(const std::vector<Request>& batch) {
+    if (batch.size() > 1)
+      return ExecuteReads(m_fs, batch, m_options.background_chunk_size);
+    return {ExecuteRequest(m_fs, batch.front(), m_options.background_chunk_size)};
+  }
+
+  std::vector<Completion> TakeCompletions(size_t max_count) {
+    const size_t count = std::min(max_count, m_completions.size());
+    std::vector<Completion> completions(std::make_move_iterator(m_completions.begin()),
+                                        std::make_move_iterator(m_completions.begin() + count));
+    m_completions.erase(m_completions.begin(), m_completions.begin() + count);
+    return completions;
+  }
+
+  FileSystem& m_fs;
+  AsyncQueueOptions m_options;
+  size_t m_max_background = 1;
+
+  mutable std::mutex m_mutex;
+  /// Signalled when a strand becomes ready to run or when the queue is being destroyed.
+  std::condition_variable m_work_cv;
+  /// Signalled when requests complete.
+  std::condition_variable m_done_cv;
+  std::deque<Completion> m_completions;
+  std::unordered_map<StrandKey, std::deque<QueuedRequest>> m_strands;
+  /// Syncs that are waiting for earlier requests to complete, in submission order.
+  std::deque<QueuedRequest> m_barriers;
+  /// Sequence numbers of the requests that have not completed yet.
+  std::set<u64> m_pending;
+  u64 m_next_sequence = 0;
+  /// Strands that are ready to run, for each priority class.
+  std::array<std::deque<StrandKey>, 2> m_ready;
+  size_t m_running_background = 0;
+  size_t m_in_flight = 0;
+  u32 m_next_key = 0;
+  bool m_stop = false;
+
+  std::vector<std::thread> m_workers;
+};
+
+}  // namespace
+
+std::unique_ptr<AsyncQueue> AsyncQueue::Create(FileSystem& fs, const AsyncQueueOptions& options) {
+  return std::make_unique<AsyncQueueImpl>(fs, options);
+}
+
+}  // namespace wiifs
@@ -0,0 +1,206 @@
+// wiifs
+// Copyright 2018 leoetlino
+// Licensed under GPLv2+
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "common/logging.h"
+#include "driver/fs.h"
+
+namespace wiifs {
+
+namespace {
+
+constexpr u16 NO_OWNER = 0xffff;
+
+/// Whether a FAT value can appear in the middle or at the end of a cluster chain.
+bool IsChainValue(u16 value) {
+  return value < SUPERBLOCK_START_CLUSTER || value == CLUSTER_LAST_IN_CHAIN;
+}
+
+bool IsFreeOrSpecial(u16 value) {
+  return value == CLUSTER_UNUSED || value == CLUSTER_RESERVED || value == CLUSTER_BAD_BLOCK ||
+         value == 0xffff;
+}
+
+}  // namespace
+
+Result<CheckReport> FileSystemImpl::Check(Fd fd, bool repair) {
+  WIIFS_PROFILE(Check);
+  std::lock_guard<std::mutex> lock{m_mutex};
+  const Handle* handle = GetHandleFromFd(fd);
+  if (!handle)
+    return ResultCode::Invalid;
+  if (handle->uid != 0)
+    return ResultCode::AccessDenied;
+  if (repair && m_read_only)
+    return ResultCode::ReadOnly;
+
+  Superblock* superblock = GetSuperblock();
+  if (!superblock)
+    return ResultCode::SuperblockInitFailed;
+
+  // Cached writes may still have to allocate clusters.
+  const ResultCode flush_result = FlushFileCache();
+  if (flush_result != ResultCode::Success)
+    return flush_result;
+
+  const auto start_time = std::chrono::steady_clock::now();
+  CheckReport report;
+  const u16 fst_size = superblock->fst.size();
+
+  // Repairs are only applied once every issue has been found (and its path computed).
+  struct BadLink {
+    u16 from;
+    bool is_sub;
+  };
+  std::vector<BadLink> bad_links;
+  std::vector<u16> chain_ends;
+  std::vector<u16> empty_files;
+  std::vector<u16> unreachable_entries;
+
+  // Every cluster and every FST entry is visited at most once, which bounds the whole check
+  // to a single pass over the FST and the FAT even if they are corrupted.
+  std::vector<u16> owners(superblock->fat.size(), NO_OWNER);
+  std::vector<bool> visited(fst_size);
+
+  // The clusters that follow the point where a chain is broken or cross-linked may still hold
+  // data of the file, so they are kept instead of being reclaimed as orphans.
+  const auto keep_rest_of_chain = [&](u16 file, u16 cluster) {
+    while (cluster < SUPERBLOCK_START_CLUSTER && owners[cluster] == NO_OWNER &&
+           !IsFreeOrSpecial(superblock->fat[cluster])) {
+      owners[cluster] = file;
+      ++report.owned_clusters;
+      cluster = superblock->fat[cluster];
+    }
+  };
+
+  const auto check_chain = [&](u16 file) {
+    const FstEntry& entry = superblock->fst[file];
+    const u32 num_clusters = (u32(entry.size) + CLUSTER_DATA_SIZE - 1) / CLUSTER_DATA_SIZE;
+    u16 cluster = entry.sub;
+    if (num_clusters == 0) {
+      if (cluster < SUPERBLOCK_START_CLUSTER) {
+        report.issues.push_back({CheckIssueType::OverlongChain, file, cluster,
+                                 GetPath(*superblock, file), repair});
+        empty_files.push_back(file);
+      }
+      return;
+    }
+
+    for (u32 chain_index = 0; chain_index < num_clusters; ++chain_index) {
+      if (cluster >= SUPERBLOCK_START_CLUSTER || !IsChainValue(superblock->fat[cluster])) {
+        report.issues.push_back(
+            {CheckIssueType::BrokenChain, file, cluster, GetPath(*superblock, file), false});
+        keep_rest_of_chain(file, cluster);
+        return;
+      }
+      if (owners[cluster] != NO_OWNER) {
+        report.issues.push_back({CheckIssueType::CrossLinkedCluster, file, cluster,
+                                 GetPath(*superblock, file), false});
+        keep_rest_of_chain(file, superblock->fat[cluster]);
+        return;
+      }
+      owners[cluster] = file;
+      ++report.owned_clusters;
+
+      const u16 next = superblock->fat[cluster];
+      if (chain_index + 1 < num_clusters) {
+        if (next == CLUSTER_LAST_IN_CHAIN) {
+          report.issues.push_back(
+              {CheckIssueType::BrokenChain, file, cluster, GetPath(*superblock, file), false});
+          return;
+        }
+        cluster = next;
+      } else if (next != CLUSTER_LAST_IN_CHAIN) {
+        // The rest of the chain is not owned by this file, so it is reclaimed as orphans.
+        report.issues.push_back({CheckIssueType::OverlongChain, file, cluster,
+                                 GetPath(*superblock, file), repair});
+        chain_ends.push_back(cluster);
+      }
+    }
+  };
+
+  visited[0] = true;
+  std::vector<u16> directories{0};
+  while (!directories.empty()) {
+    const u16 directory = directories.back();
+    directories.pop_back();
+    ++report.directories;
+
+    u16 from = directory;
+    for (u16 child = superblock->fst[directory].sub; child < fst_size;
+         child = superblock->fst[child].sib) {
+      const FstEntry& entry = superblock->fst[child];
+      if (visited[child] || (!entry.IsFile() && !entry.IsDirectory())) {
+        report.issues.push_back(
+            {CheckIssueType::BadFstLink, from, 0xffff, GetPath(*superblock, from), repair});
+        bad_links.push_back({from, from == directory});
+        break;
+      }
+      visited[child] = true;
+      if (entry.IsFile()) {
+        ++report.files;
+        check_chain(child);
+      } else {
+        directories.push_back(child);
+      }
+      from = child;
+    }
+  }
+
+  for (u16 index = 0; index < fst_size; ++index) {
+    const FstEntry& entry = superblock->fst[index];
+    if (visited[index] || (entry.mode & 3) == 0)
+      continue;
+    report.issues.push_back({CheckIssueType::UnreachableEntry, index, 0xffff,
+                             std::string{entry.GetNameView()}, repair});
+    unreachable_entries.push_back(index);
+  }
+
+  std::vector<u16> orphans;
+  for (u16 cluster = 0; cluster < SUPERBLOCK_START_CLUSTER; ++cluster) {
+    if (owners[cluster] != NO_OWNER || IsFreeOrSpecial(superblock->fat[cluster]))
+      continue;
+    report.issues.push_back({CheckIssueType::OrphanCluster, 0xffff, cluster, {}, repair});
+    orphans.push_back(cluster);
+  }
+
+  ResultCode result = ResultCode::Success;
+  const bool repairable = !bad_links.empty() || !chain_ends.empty() || !empty_files.empty() ||
+                          !unreachable_entries.empty() || !orphans.empty();
+  if (repair && repairable) {
+    for (const BadLink& link : bad_links) {
+      if (link.is_sub)
+        superblock->fst[link.from].sub = 0xffff;
+      else
+        superblock->fst[link.from].sib = 0xffff;
+    }
+    for (const u16 cluster : chain_ends)
+      superblock->fat[cluster] = CLUSTER_LAST_IN_CHAIN;
+    // Empty files do not have any cluster (see CreateFileOrDirectory).
+    for (const u16 index : empty_files)
+      superblock->fst[index].sub = CLUSTER_LAST_IN_CHAIN;
+    for (const u16 index : unreachable_entries)
+      superblock->fst[index].mode = 0;
+    for (const u16 cluster : orphans) {
+      superblock->fat[cluster] = CLUSTER_UNUSED;
+      m_verified_clusters.Clear(cluster);
+    }
+    report.freed_clusters = orphans.size();
+    result = FlushSuperblock();
+  }
+
+  report.elapsed_seconds =
+      std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+  DebugLog("Check: %u files, %u directories, %zu issues\n", report.files, report.directories,
+           report.issues.size());
+  if (result != ResultCode::Success)
+    return result;
+  return report;
+}
+
+}  // namespace wiifs
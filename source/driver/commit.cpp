@@ -0,0 +1,104 @@
+// wiifs
+// Copyright 2018 leoetlino
+// Licensed under GPLv2+
+
+#include <chrono>
+#include <mutex>
+
+#include "common/logging.h"
+#include "driver/fs.h"
+
+namespace wiifs {
+
+CommitToken FileSystemImpl::GetCommitToken() {
+  std::lock_guard<std::mutex> lock{m_mutex};
+  return m_change_token;
+}
+
+ResultCode FileSystemImpl::WaitForCommit(CommitToken token) {
+  WIIFS_PROFILE(WaitForCommit);
+  std::unique_lock<std::mutex> lock{m_mutex};
+  if (token > m_change_token)
+    return ResultCode::Invalid;
+  return Sync(lock, token);
+}
+
+ResultCode FileSystemImpl::WaitForCommit(std::unique_lock<std::mutex>& lock, CommitToken token) {
+  if (!m_options.async_commit) {
+    // Only reached if the last superblock write failed.
+    if (m_committed_token < token)
+      return FlushSuperblock();
+    return ResultCode::Success;
+  }
+
+  // A commit that is still in flight must be waited for even if it is not needed for this
+  // state: the caller may be about to flush the superblock clusters.
+  if (m_committed_token >= token && !m_commit_in_progress)
+    return ResultCode::Success;
+
+  m_commit_requested = true;
+  m_commit_error = ResultCode::Success;
+  m_commit_cv.notify_all();
+  m_commit_done_cv.wait(lock, [&] {
+    return !m_commit_in_progress &&
+           (m_committed_token >= token || m_commit_error != ResultCode::Success);
+  });
+  return m_committed_token >= token ? ResultCode::Success : m_commit_error;
+}
+
+void FileSystemImpl::CommitThread() {
+  std::unique_lock<std::mutex> lock{m_mutex};
+  while (true) {
+    m_commit_cv.wait(lock, [this] {
+      return m_stop_commit_thread || m_commit_requested || m_change_token != m_commit_token;
+    });
+    if (m_change_token == m_commit_token) {
+      m_commit_requested = false;
+      m_commit_done_cv.notify_all();
+      if (m_stop_commit_thread)
+        return;
+      continue;
+    }
+
+    // Give later changes a chance to be coalesced into the same commit.
+    const auto deadline =
+        std::chrono::steady_clock::now() + std::chrono::milliseconds{m_options.commit_interval_ms};
+    m_commit_cv.wait_until(lock, deadline, [this] {
+      return m_stop_commit_thread || m_commit_requested ||
+             m_change_token - m_commit_token >= m_options.commit_max_changes;
+    });
+
+    // Only the copy is written, so callers can keep changing the metadata in the meantime.
+    // Clusters that the new superblock uses must not be reused before it is fully written,
+    // and neither may those of the previous one in case the write fails.
+    const CommitToken token = m_change_token;
+    *m_commit_snapshot = *m_superblock;
+    const auto previous_committed_fat = m_committed_fat;
+    for (size_t i = 0; i < m_committed_fat.size(); ++i) {
+      if (m_committed_fat[i] == CLUSTER_UNUSED)
+        m_committed_fat[i] = m_superblock->fat[i];
+    }
+    m_commit_token = token;
+    m_commit_requested = false;
+    m_commit_in_progress = true;
+
+    lock.unlock();
+    const ResultCode result = WriteSuperblock(m_commit_snapshot.get());
+    lock.lock();
+
+    m_commit_in_progress = false;
+    m_commit_error = result;
+    if (result == ResultCode::Success) {
+      m_superblock->version = m_commit_snapshot->version;
+      m_committed_fat = m_commit_snapshot->fat;
+      m_committed_token = token;
+    } else {
+      DebugLog("Error: Failed to commit superblock\n");
+      m_committed_fat = previous_committed_fat;
+      m_commit_token = m_committed_token;
+    }
+    m_commit_done_cv.notify_all();
+  }
+}
+
+}  // namespace wiifs
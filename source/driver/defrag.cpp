@@ -0,0 +1,191 @@
+// wiifs
+// Copyright 2018 leoetlino
+// Licensed under GPLv2+
+
+#include <algorithm>
+#include <optional>
+#include <vector>
+
+#include "common/logging.h"
+#include "driver/fs.h"
+
+namespace wiifs {
+
+namespace {
+
+/// Get the clusters of a file in chain order. Returns false if the chain is broken.
+bool GetFileClusters(const Superblock& superblock, const FstEntry& entry,
+                     std::vector<u16>* clusters) {
+  clusters->clear();
+  const u32 num_clusters = (u32(entry.size) + CLUSTER_DATA_SIZE - 1) / CLUSTER_DATA_SIZE;
+  u16 cluster = entry.sub;
+  for (u32 i = 0; i < num_clusters; ++i) {
+    if (cluster >= SUPERBLOCK_START_CLUSTER || clusters->size() >= SUPERBLOCK_START_CLUSTER)
+      return false;
+    clusters->push_back(cluster);
+    cluster = superblock.fat[cluster];
+  }
+  return true;
+}
+
+/// Get the number of runs of physically contiguous clusters in a chain.
+u32 CountExtents(const std::vector<u16>& clusters) {
+  u32 extents = clusters.empty() ? 0 : 1;
+  for (size_t i = 1; i < clusters.size(); ++i) {
+    if (clusters[i] != clusters[i - 1] + 1)
+      ++extents;
+  }
+  return extents;
+}
+
+FragmentationReport GetFragmentation(const Superblock& superblock) {
+  FragmentationReport report;
+  std::vector<u16> clusters;
+  for (const FstEntry& entry : superblock.fst) {
+    if (!entry.IsFile() || !GetFileClusters(superblock, entry, &clusters) || clusters.empty())
+      continue;
+    const u32 extents = CountExtents(clusters);
+    ++report.files;
+    report.fragmented_files += extents > 1;
+    report.file_clusters += clusters.size();
+    report.extents += extents;
+  }
+  return report;
+}
+
+struct FreeRun {
+  u16 start;
+  u16 count;
+};
+
+/// Take the first free run that can hold `count` clusters.
+std::optional<u16> AllocateRun(std::vector<FreeRun>* runs, u32 count) {
+  for (FreeRun& run : *runs) {
+    if (run.count < count)
+      continue;
+    const u16 start = run.start;
+    run.start += count;
+    run.count -= count;
+    return start;
+  }
+  return {};
+}
+
+}  // namespace
+
+Result<FragmentationReport> FileSystemImpl::GetFragmentationReport(Fd fd) {
+  WIIFS_PROFILE(GetFragmentationReport);
+  std::lock_guard<std::mutex> lock{m_mutex};
+  const Handle* handle = GetHandleFromFd(fd);
+  if (!handle)
+    return ResultCode::Invalid;
+
+  const auto* superblock = GetSuperblock();
+  if (!superblock)
+    return ResultCode::SuperblockInitFailed;
+
+  return GetFragmentation(*superblock);
+}
+
+Result<DefragmentReport> FileSystemImpl::Defragment(Fd fd, u32 max_clusters) {
+  WIIFS_PROFILE(Defragment);
+  std::lock_guard<std::mutex> lock{m_mutex};
+  const Handle* handle = GetHandleFromFd(fd);
+  if (!handle)
+    return ResultCode::Invalid;
+  if (handle->uid != 0)
+    return ResultCode::AccessDenied;
+  if (m_read_only)
+    return ResultCode::ReadOnly;
+
+  auto* superblock = GetSuperblock();
+  if (!superblock)
+    return ResultCode::SuperblockInitFailed;
+
+  // Cached writes may still have to allocate clusters.
+  ResultCode result = FlushFileCache();
+  if (result != ResultCode::Success)
+    return result;
+
+  // Clusters that the last written superblock still uses must be left alone until the new
+  // chains are committed, so that a crash part way leaves every file intact.
+  Count(m_perf.fat_scans);
+  std::vector<FreeRun> free_runs;
+  for (u16 cluster = 0; cluster < SUPERBLOCK_START_CLUSTER; ++cluster) {
+    if (superblock->fat[cluster] != CLUSTER_UNUSED || m_committed_fat[cluster] != CLUSTER_UNUSED ||
+        m_reserved_clusters.Test(cluster)) {
+      continue;
+    }
+    if (!free_runs.empty() && free_runs.back().start + free_runs.back().count == cluster)
+      ++free_runs.back().count;
+    else
+      free_runs.push_back({cluster, 1});
+  }
+
+  DefragmentReport report;
+  std::vector<u16> clusters;
+  std::vector<u8> raw;
+  u32 budget = max_clusters;
+  for (u16 index = 0; index < superblock->fst.size(); ++index) {
+    FstEntry& entry = superblock->fst[index];
+    if (!entry.IsFile() || !GetFileClusters(*superblock, entry, &clusters) ||
+        CountExtents(clusters) <= 1) {
+      continue;
+    }
+
+    const u32 count = clusters.size();
+    const std::optional<u16> start =
+        count <= budget ? AllocateRun(&free_runs, count) : std::nullopt;
+    if (!start) {
+      ++report.skipped_files;
+      continue;
+    }
+
+    // AES-CBC uses a zero IV for every cluster and the HMAC salt does not depend on the
+    // physical location, so raw pages (including ECC and HMACs) can be copied as is.
+    raw.resize(size_t(count) * CLUSTER_RAW_SIZE);
+    for (u32 i = 0, end; i < count && result == ResultCode::Success; i = end) {
+      for (end = i + 1; end < count && clusters[end] == clusters[end - 1] + 1; ++end) {
+      }
+      result = m_storage->ReadPages(PageIndex(clusters[i]), (end - i) * PAGES_PER_CLUSTER,
+                                    &raw[size_t(i) * CLUSTER_RAW_SIZE]);
+    }
+    if (result == ResultCode::Success)
+      result = m_storage->WritePages(PageIndex(*start), count * PAGES_PER_CLUSTER, raw.data());
+    if (result != ResultCode::Success)
+      break;
+    Count(m_perf.clusters_read, count);
+    Count(m_perf.clusters_written, count);
+
+    for (u32 i = 0; i < count; ++i) {
+      const u16 cluster = *start + i;
+      m_dirty_clusters.Set(cluster);
+      if (m_verified_clusters.TestAndClear(clusters[i]))
+        m_verified_clusters.Set(cluster);
+      else
+        m_verified_clusters.Clear(cluster);
+      superblock->fat[cluster] = i + 1 < count ? cluster + 1 : CLUSTER_LAST_IN_CHAIN;
+      superblock->fat[clusters[i]] = CLUSTER_UNUSED;
+    }
+    entry.sub = *start;
+    DebugLog("Defragment: moved %u clusters of FST entry %u to 0x%04x\n", count, index, *start);
+
+    budget -= count;
+    report.moved_clusters += count;
+    ++report.defragmented_files;
+  }
+
+  // Commit whatever was moved, even if a later file failed.
+  if (report.defragmented_files != 0) {
+    const ResultCode flush_result = FlushSuperblock();
+    if (result == ResultCode::Success)
+      result = flush_result;
+  }
+  if (result != ResultCode::Success)
+    return result;
+
+  report.fragmentation = GetFragmentation(*superblock);
+  return report;
+}
+
+}  // namespace wiifs
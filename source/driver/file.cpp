@@ -4,6 +4,7 @@
 
 #include <algorithm>
 
+#include "common/align.h"
 #include "common/logging.h"
 #include "driver/fs.h"
 #include "driver/util.h"
@@ -11,6 +12,8 @@
 namespace wiifs {
 
 Result<Fd> FileSystemImpl::OpenFs(Uid uid, Gid gid) {
+  WIIFS_PROFILE(OpenFs);
+  std::lock_guard<std::mutex> lock{m_mutex};
   Handle* handle = AssignFreeHandle(uid, gid);
   if (!handle)
     return ResultCode::NoFreeHandle;
@@ -18,6 +21,8 @@ Result<Fd> FileSystemImpl::OpenFs(Uid uid, Gid gid) {
 }
 
 Result<Fd> FileSystemImpl::OpenFile(Uid uid, Gid gid, const std::string& path, FileMode mode) {
+  WIIFS_PROFILE(OpenFile);
+  std::lock_guard<std::mutex> lock{m_mutex};
   if (!IsValidNonRootPath(path))
     return ResultCode::Invalid;
 
@@ -29,29 +34,53 @@ Result<Fd> FileSystemImpl::OpenFile(Uid uid, Gid gid, const std::string& path, F
   if (!index)
     return ResultCode::NotFound;
 
-  if (!superblock->fst[*index].IsFile())
+  return OpenFileHandle(*superblock, uid, gid, *index, mode);
+}
+
+Result<Fd> FileSystemImpl::OpenFileByIndex(Uid uid, Gid gid, u16 fst_index, FileMode mode) {
+  WIIFS_PROFILE(OpenFileByIndex);
+  std::lock_guard<std::mutex> lock{m_mutex};
+  const auto* superblock = GetSuperblock();
+  if (!superblock)
+    return ResultCode::SuperblockInitFailed;
+
+  if (!GetParentIndex(*superblock, fst_index))
+    return ResultCode::NotFound;
+
+  return OpenFileHandle(*superblock, uid, gid, fst_index, mode);
+}
+
+Result<Fd> FileSystemImpl::OpenFileHandle(const Superblock& superblock, Uid uid, Gid gid,
+                                          u16 fst_index, FileMode mode) {
+  if (!superblock.fst[fst_index].IsFile())
     return ResultCode::Invalid;
 
-  if (!HasPermission(superblock->fst[*index], uid, gid, mode))
+  if (m_read_only && u8(mode & FileMode::Write) != 0)
+    return ResultCode::ReadOnly;
+
+  if (!HasPermission(superblock.fst[fst_index], uid, gid, mode))
     return ResultCode::AccessDenied;
 
   Handle* handle = AssignFreeHandle(uid, gid);
   if (!handle)
     return ResultCode::NoFreeHandle;
-  handle->fst_index = *index;
+  handle->fst_index = fst_index;
   handle->mode = mode;
   handle->file_offset = 0;
   // For one handle, the file size is stored once and never touched again except for writes.
   // This means that if the same file is opened twice, and the second handle is used to
   // grow the file, the first handle will not be able to read past the original size.
-  handle->file_size = superblock->fst[*index].size;
+  handle->file_size = superblock.fst[fst_index].size;
   return ConvertHandleToFd(handle);
 }
 
 ResultCode FileSystemImpl::PopulateFileCache(Handle* handle, u32 offset, bool write) {
   const u16 chain_index = offset / CLUSTER_DATA_SIZE;
-  if (m_cache_handle == handle && m_cache_chain_index == chain_index)
+  if (m_cache_handle == handle && m_cache_chain_index == chain_index) {
+    Count(m_perf.cache_hits);
     return ResultCode::Success;
+  }
+  Count(m_perf.cache_misses);
 
   const auto flush_result = FlushFileCache();
   if (flush_result != ResultCode::Success)
@@ -87,7 +116,22 @@ ResultCode FileSystemImpl::FlushFileCache() {
   return result;
 }
 
+ResultCode FileSystemImpl::EvictFileCache(u16 fst_index) {
+  if (!m_cache_handle || m_cache_handle->fst_index != fst_index)
+    return ResultCode::Success;
+
+  const auto flush_result = FlushFileCache();
+  if (flush_result != ResultCode::Success)
+    return flush_result;
+
+  m_cache_handle = nullptr;
+  m_cache_data.clear();
+  return ResultCode::Success;
+}
+
 ResultCode FileSystemImpl::Close(Fd fd) {
+  WIIFS_PROFILE(Close);
+  std::lock_guard<std::mutex> lock{m_mutex};
   Handle* handle = GetHandleFromFd(fd);
   if (!handle)
     return ResultCode::Invalid;
@@ -107,67 +151,197 @@ ResultCode FileSystemImpl::Close(Fd fd) {
       return result;
   }
 
+  ReleaseReservation(handle);
   *handle = Handle{};
   return ResultCode::Success;
 }
 
+/// Get the order in which I/O segments should be processed: by offset, so that each cluster
+/// is only loaded into the file cache once and clusters are accessed in chain order.
+template <typename Segment>
+static std::vector<size_t> SortSegmentsByOffset(const std::vector<Segment>& segments) {
+  std::vector<size_t> order(segments.size());
+  for (size_t i = 0; i < order.size(); ++i)
+    order[i] = i;
+  std::stable_sort(order.begin(), order.end(), [&segments](size_t a, size_t b) {
+    return segments[a].offset < segments[b].offset;
+  });
+  return order;
+}
+
 Result<u32> FileSystemImpl::ReadFile(Fd fd, u8* ptr, u32 count) {
+  WIIFS_PROFILE(ReadFile);
+  std::lock_guard<std::mutex> lock{m_mutex};
+  Handle* handle = GetHandleFromFd(fd);
+  if (!handle || handle->fst_index >= std::tuple_size<decltype(Superblock::fst)>::value)
+    return ResultCode::Invalid;
+
+  return ReadFileAt(handle, &handle->file_offset, ptr, count);
+}
+
+Result<u32> FileSystemImpl::ReadFileAt(Fd fd, u32 offset, u8* ptr, u32 count) {
+  WIIFS_PROFILE(ReadFileAt);
+  std::lock_guard<std::mutex> lock{m_mutex};
+  Handle* handle = GetHandleFromFd(fd);
+  if (!handle || handle->fst_index >= std::tuple_size<decltype(Superblock::fst)>::value)
+    return ResultCode::Invalid;
+
+  return ReadFileAt(handle, &offset, ptr, count);
+}
+
+Result<u32> FileSystemImpl::ReadFileV(Fd fd, const std::vector<IoSegment>& segments) {
+  WIIFS_PROFILE(ReadFileV);
+  std::lock_guard<std::mutex> lock{m_mutex};
   Handle* handle = GetHandleFromFd(fd);
   if (!handle || handle->fst_index >= std::tuple_size<decltype(Superblock::fst)>::value)
     return ResultCode::Invalid;
 
+  u32 total = 0;
+  for (const size_t i : SortSegmentsByOffset(segments)) {
+    u32 offset = segments[i].offset;
+    const auto result = ReadFileAt(handle, &offset, segments[i].ptr, segments[i].size);
+    if (!result)
+      return result.Error();
+    total += *result;
+  }
+  return total;
+}
+
+Result<u32> FileSystemImpl::ReadFileAt(Handle* handle, u32* offset, u8* ptr, u32 count) {
   if (u8(handle->mode & FileMode::Read) == 0)
     return ResultCode::AccessDenied;
 
-  if (count + handle->file_offset > handle->file_size)
-    count = handle->file_size - handle->file_offset;
+  if (*offset > handle->file_size)
+    return ResultCode::Invalid;
+
+  if (count + *offset > handle->file_size)
+    count = handle->file_size - *offset;
 
   u32 processed_count = 0;
   while (processed_count != count) {
-    const auto result = PopulateFileCache(handle, handle->file_offset, false);
+    // Large cluster-aligned reads bypass the file cache: clusters are decrypted and verified
+    // directly into the output buffer by several worker threads.
+    const u32 num_clusters = (count - processed_count) / CLUSTER_DATA_SIZE;
+    if (*offset % CLUSTER_DATA_SIZE == 0 && num_clusters >= PARALLEL_MIN_CLUSTERS) {
+      // Unflushed writes to the same file must reach the NAND first.
+      const auto evict_result = EvictFileCache(handle->fst_index);
+      if (evict_result != ResultCode::Success)
+        return evict_result;
+
+      u32 num_read = 0;
+      const auto result = ReadFileData(handle->fst_index, *offset / CLUSTER_DATA_SIZE,
+                                       num_clusters, ptr + processed_count, &num_read);
+      *offset += num_read * CLUSTER_DATA_SIZE;
+      processed_count += num_read * CLUSTER_DATA_SIZE;
+      if (result != ResultCode::Success)
+        return result;
+      continue;
+    }
+
+    const auto result = PopulateFileCache(handle, *offset, false);
     if (result != ResultCode::Success)
       return result;
 
-    const auto start =
-        m_cache_data.begin() + (handle->file_offset - m_cache_chain_index * CLUSTER_DATA_SIZE);
+    const auto start = m_cache_data.begin() + (*offset - m_cache_chain_index * CLUSTER_DATA_SIZE);
     const size_t copy_length =
         std::min<size_t>(m_cache_data.end() - start, count - processed_count);
 
     std::copy_n(start, copy_length, ptr + processed_count);
-    handle->file_offset += copy_length;
+    *offset += copy_length;
     processed_count += copy_length;
   }
   return count;
 }
 
 Result<u32> FileSystemImpl::WriteFile(Fd fd, const u8* ptr, u32 count) {
+  WIIFS_PROFILE(WriteFile);
+  std::lock_guard<std::mutex> lock{m_mutex};
+  Handle* handle = GetHandleFromFd(fd);
+  if (!handle || handle->fst_index >= std::tuple_size<decltype(Superblock::fst)>::value)
+    return ResultCode::Invalid;
+
+  return WriteFileAt(handle, &handle->file_offset, ptr, count);
+}
+
+Result<u32> FileSystemImpl::WriteFileAt(Fd fd, u32 offset, const u8* ptr, u32 count) {
+  WIIFS_PROFILE(WriteFileAt);
+  std::lock_guard<std::mutex> lock{m_mutex};
+  Handle* handle = GetHandleFromFd(fd);
+  if (!handle || handle->fst_index >= std::tuple_size<decltype(Superblock::fst)>::value)
+    return ResultCode::Invalid;
+
+  return WriteFileAt(handle, &offset, ptr, count);
+}
+
+Result<u32> FileSystemImpl::WriteFileV(Fd fd, const std::vector<ConstIoSegment>& segments) {
+  WIIFS_PROFILE(WriteFileV);
+  std::lock_guard<std::mutex> lock{m_mutex};
   Handle* handle = GetHandleFromFd(fd);
   if (!handle || handle->fst_index >= std::tuple_size<decltype(Superblock::fst)>::value)
     return ResultCode::Invalid;
 
+  u32 total = 0;
+  for (const size_t i : SortSegmentsByOffset(segments)) {
+    u32 offset = segments[i].offset;
+    const auto result = WriteFileAt(handle, &offset, segments[i].ptr, segments[i].size);
+    if (!result)
+      return result.Error();
+    total += *result;
+  }
+  return total;
+}
+
+Result<u32> FileSystemImpl::WriteFileAt(Handle* handle, u32* offset, const u8* ptr, u32 count) {
   if (u8(handle->mode & FileMode::Write) == 0)
     return ResultCode::AccessDenied;
 
+  // This differs from POSIX behaviour which allows writing past the end of the file.
+  if (*offset > handle->file_size)
+    return ResultCode::Invalid;
+
   u32 processed_count = 0;
   while (processed_count != count) {
-    const auto result = PopulateFileCache(handle, handle->file_offset, true);
+    // Large cluster-aligned writes bypass the file cache and are written in one go,
+    // which lets the cluster crypto and ECC run on several worker threads.
+    const u32 num_clusters = (count - processed_count) / CLUSTER_DATA_SIZE;
+    if (*offset % CLUSTER_DATA_SIZE == 0 && num_clusters >= PARALLEL_MIN_CLUSTERS) {
+      const auto evict_result = EvictFileCache(handle->fst_index);
+      if (evict_result != ResultCode::Success)
+        return evict_result;
+
+      const u32 length = num_clusters * CLUSTER_DATA_SIZE;
+      const u32 new_size = std::max(*offset + length, handle->file_size);
+      const auto result = WriteFileData(handle->fst_index, ptr + processed_count,
+                                        *offset / CLUSTER_DATA_SIZE, num_clusters, new_size);
+      if (result != ResultCode::Success)
+        return result;
+
+      handle->superblock_flush_needed = true;
+      *offset += length;
+      processed_count += length;
+      handle->file_size = new_size;
+      continue;
+    }
+
+    const auto result = PopulateFileCache(handle, *offset, true);
     if (result != ResultCode::Success)
       return result;
 
-    const auto start =
-        m_cache_data.begin() + (handle->file_offset - m_cache_chain_index * CLUSTER_DATA_SIZE);
+    const auto start = m_cache_data.begin() + (*offset - m_cache_chain_index * CLUSTER_DATA_SIZE);
     const size_t copy_length =
         std::min<size_t>(m_cache_data.end() - start, count - processed_count);
 
     std::copy_n(ptr + processed_count, copy_length, start);
-    handle->file_offset += copy_length;
+    *offset += copy_length;
     processed_count += copy_length;
-    handle->file_size = std::max(handle->file_offset, handle->file_size);
+    handle->file_size = std::max(*offset, handle->file_size);
   }
   return count;
 }
 
 Result<u32> FileSystemImpl::SeekFile(Fd fd, std::uint32_t offset, SeekMode mode) {
+  WIIFS_PROFILE(SeekFile);
+  std::lock_guard<std::mutex> lock{m_mutex};
   Handle* handle = GetHandleFromFd(fd);
   if (!handle || handle->fst_index >= std::tuple_size<decltype(Superblock::fst)>::value)
     return ResultCode::Invalid;
@@ -196,6 +370,8 @@ Result<u32> FileSystemImpl::SeekFile(Fd fd, std::uint32_t offset, SeekMode mode)
 }
 
 Result<FileStatus> FileSystemImpl::GetFileStatus(Fd fd) {
+  WIIFS_PROFILE(GetFileStatus);
+  std::lock_guard<std::mutex> lock{m_mutex};
   const Handle* handle = GetHandleFromFd(fd);
   if (!handle || handle->fst_index >= std::tuple_size<decltype(Superblock::fst)>::value)
     return ResultCode::Invalid;
@@ -209,6 +385,58 @@ Result<FileStatus> FileSystemImpl::GetFileStatus(Fd fd) {
   return status;
 }
 
+ResultCode FileSystemImpl::Preallocate(Fd fd, u32 size) {
+  WIIFS_PROFILE(Preallocate);
+  std::lock_guard<std::mutex> lock{m_mutex};
+  Handle* handle = GetHandleFromFd(fd);
+  if (!handle || handle->fst_index >= std::tuple_size<decltype(Superblock::fst)>::value)
+    return ResultCode::Invalid;
+
+  if (u8(handle->mode & FileMode::Write) == 0)
+    return ResultCode::AccessDenied;
+
+  // The file size must be up to date to know which clusters are still needed.
+  const auto evict_result = EvictFileCache(handle->fst_index);
+  if (evict_result != ResultCode::Success)
+    return evict_result;
+
+  const auto* superblock = GetSuperblock();
+  if (!superblock)
+    return ResultCode::SuperblockInitFailed;
+
+  ReleaseReservation(handle);
+  const u32 file_size = superblock->fst[handle->fst_index].size;
+  if (size <= file_size)
+    return ResultCode::Success;
+
+  // A partial last cluster is rewritten when the file grows, so it is reserved as well.
+  const u32 first_chain_index = file_size / CLUSTER_DATA_SIZE;
+  const u32 count = AlignUp<u32>(size, CLUSTER_DATA_SIZE) / CLUSTER_DATA_SIZE - first_chain_index;
+  Count(m_perf.fat_scans);
+  u32 run_length = 0;
+  for (u16 cluster = 0; cluster < SUPERBLOCK_START_CLUSTER; ++cluster) {
+    // Like in WriteFileData, clusters that the last written superblock still references
+    // must not be handed out before that superblock has been replaced.
+    if (superblock->fat[cluster] != CLUSTER_UNUSED || m_committed_fat[cluster] != CLUSTER_UNUSED ||
+        m_reserved_clusters.Test(cluster)) {
+      run_length = 0;
+      continue;
+    }
+    if (++run_length != count)
+      continue;
+
+    handle->reserved_chain_index = first_chain_index;
+    handle->reserved_cluster = cluster + 1 - count;
+    handle->reserved_count = count;
+    for (u32 i = 0; i < count; ++i)
+      m_reserved_clusters.Set(handle->reserved_cluster + i);
+    DebugLog("Reserved %u clusters at 0x%04x for FST entry %u\n", count,
+             handle->reserved_cluster, handle->fst_index);
+    return ResultCode::Success;
+  }
+  return ResultCode::NoFreeSpace;
+}
+
 FileSystemImpl::Handle* FileSystemImpl::AssignFreeHandle(Uid uid, Gid gid) {
   const auto it = std::find_if(m_handles.begin(), m_handles.end(),
                                [](const Handle& handle) { return !handle.opened; });
@@ -3,6 +3,7 @@
 // Licensed under GPLv2+
 
 #include <algorithm>
+#include <optional>
 
 #include "common/logging.h"
 #include "driver/fs.h"
@@ -10,8 +11,19 @@
 
 namespace wiifs {
 
-FileSystemImpl::FileSystemImpl(u8* nand_bytes, const FileSystemKeys& keys)
-    : m_nand{nand_bytes}, m_keys{keys} {
+FileSystemImpl::FileSystemImpl(std::unique_ptr<Storage> storage, const FileSystemKeys& keys,
+                               const FileSystemOptions& options, bool read_only)
+    : m_storage{std::move(storage)}, m_options{options}, m_read_only{read_only}, m_keys{keys} {
+  // Nothing is known about clusters that are free on the storage, so they are all discarded
+  // on the first sync. This also makes a fully allocated image sparse.
+  m_committed_fat.fill(BigEndianValue<u16>{CLUSTER_LAST_IN_CHAIN});
+  m_synced_fat.fill(BigEndianValue<u16>{CLUSTER_LAST_IN_CHAIN});
+
+  if (m_options.async_commit && !m_read_only) {
+    m_commit_snapshot = std::make_unique<Superblock>();
+    m_commit_thread = std::thread{[this] { CommitThread(); }};
+  }
+
   auto* superblock = GetSuperblock();
   if (!superblock)
     return;
@@ -19,13 +31,47 @@ FileSystemImpl::FileSystemImpl(u8* nand_bytes, const FileSystemKeys& keys)
   for (auto& cluster : superblock->fat)
     if (cluster == 0xffff)
       cluster = CLUSTER_UNUSED;
+  m_committed_fat = superblock->fat;
+}
+
+FileSystemImpl::~FileSystemImpl() {
+  if (!m_commit_thread.joinable())
+    return;
+  // The commit thread writes whatever is still pending before it exits.
+  {
+    std::lock_guard<std::mutex> lock{m_mutex};
+    m_stop_commit_thread = true;
+  }
+  m_commit_cv.notify_all();
+  m_commit_thread.join();
 }
 
 std::unique_ptr<FileSystem> FileSystem::Create(u8* nand_bytes, const FileSystemKeys& keys) {
-  return std::make_unique<FileSystemImpl>(nand_bytes, keys);
+  return Create(Storage::CreateForMemory(nand_bytes), keys);
+}
+
+std::unique_ptr<FileSystem> FileSystem::Create(std::unique_ptr<Storage> storage,
+                                               const FileSystemKeys& keys,
+                                               const FileSystemOptions& options) {
+  return std::make_unique<FileSystemImpl>(std::move(storage), keys, options, false);
+}
+
+std::unique_ptr<FileSystem> FileSystem::CreateReadOnly(const u8* nand_bytes,
+                                                       const FileSystemKeys& keys) {
+  return CreateReadOnly(Storage::CreateForReadOnlyMemory(nand_bytes), keys);
+}
+
+std::unique_ptr<FileSystem> FileSystem::CreateReadOnly(std::unique_ptr<Storage> storage,
+                                                       const FileSystemKeys& keys,
+                                                       const FileSystemOptions& options) {
+  return std::make_unique<FileSystemImpl>(std::move(storage), keys, options, true);
 }
 
 ResultCode FileSystemImpl::Format(Uid uid) {
+  WIIFS_PROFILE(Format);
+  std::unique_lock<std::mutex> lock{m_mutex};
+  if (m_read_only)
+    return ResultCode::ReadOnly;
   if (uid != 0)
     return ResultCode::AccessDenied;
 
@@ -52,14 +98,48 @@ ResultCode FileSystemImpl::Format(Uid uid) {
 
   for (Handle& handle : m_handles)
     handle.opened = false;
+  m_verified_clusters.ClearAll();
+  m_reserved_clusters.ClearAll();
 
-  return FlushSuperblock();
+  // Clusters of the previous file system cannot be reused before the new superblock is written,
+  // so that is always done right away.
+  const ResultCode result = FlushSuperblock();
+  if (result != ResultCode::Success)
+    return result;
+  return WaitForCommit(lock, m_change_token);
+}
+
+ResultCode FileSystemImpl::Sync() {
+  WIIFS_PROFILE(Sync);
+  std::unique_lock<std::mutex> lock{m_mutex};
+  return Sync(lock, m_change_token);
+}
+
+ResultCode FileSystemImpl::Sync(std::unique_lock<std::mutex>& lock, CommitToken token) {
+  if (m_read_only)
+    return ResultCode::Success;
+  const ResultCode commit_result = WaitForCommit(lock, token);
+  if (commit_result != ResultCode::Success)
+    return commit_result;
+  // Data clusters that no superblock references yet (such as those of open files) are only
+  // made durable here; WriteSuperblock takes care of the others.
+  const ResultCode result = FlushDirtyClusters(0, SUPERBLOCK_START_CLUSTER);
+  if (result != ResultCode::Success)
+    return result;
+  const ResultCode superblock_result = FlushDirtyClusters(SUPERBLOCK_START_CLUSTER, 0x8000);
+  if (superblock_result != ResultCode::Success)
+    return superblock_result;
+  DiscardFreedClusters();
+  return ResultCode::Success;
 }
 
 ResultCode FileSystemImpl::CreateFileOrDirectory(const Handle* handle, const std::string& path,
                                                  FileAttribute attribute, FileMode owner_mode,
                                                  FileMode group_mode, FileMode other_mode,
                                                  bool is_file) {
+  if (m_read_only)
+    return ResultCode::ReadOnly;
+
   if (!IsValidNonRootPath(path) ||
       std::any_of(path.begin(), path.end(), [](char c) { return c - ' ' > 0x5e; })) {
     return ResultCode::Invalid;
@@ -106,6 +186,8 @@ ResultCode FileSystemImpl::CreateFileOrDirectory(const Handle* handle, const std
 ResultCode FileSystemImpl::CreateFile(Fd fd, const std::string& path, FileAttribute attribute,
                                       FileMode owner_mode, FileMode group_mode,
                                       FileMode other_mode) {
+  WIIFS_PROFILE(CreateFile);
+  std::lock_guard<std::mutex> lock{m_mutex};
   const Handle* handle = GetHandleFromFd(fd);
   if (!handle)
     return ResultCode::Invalid;
@@ -116,6 +198,8 @@ ResultCode FileSystemImpl::CreateFile(Fd fd, const std::string& path, FileAttrib
 ResultCode FileSystemImpl::CreateDirectory(Fd fd, const std::string& path, FileAttribute attribute,
                                            FileMode owner_mode, FileMode group_mode,
                                            FileMode other_mode) {
+  WIIFS_PROFILE(CreateDirectory);
+  std::lock_guard<std::mutex> lock{m_mutex};
   const Handle* handle = GetHandleFromFd(fd);
   if (!handle)
     return ResultCode::Invalid;
@@ -125,12 +209,13 @@ ResultCode FileSystemImpl::CreateDirectory(Fd fd, const std::string& path, FileA
 
 /// Delete a file.
 /// A valid file FST index must be passed.
-static void DeleteFile(Superblock* superblock, u16 file) {
+static void DeleteFile(Superblock* superblock, u16 file, AtomicBitmap<0x8000>* verified) {
   // Free all clusters that were used by the file.
   for (u16 i = superblock->fst[file].sub; i < superblock->fat.size();) {
     DebugLog("DeleteFile: Freeing cluster 0x%04x\n", i);
     const u16 next = superblock->fat[i];
     superblock->fat[i] = CLUSTER_UNUSED;
+    verified->Clear(i);
     i = next;
   }
 
@@ -140,14 +225,15 @@ static void DeleteFile(Superblock* superblock, u16 file) {
 
 /// Recursively delete all files in a directory (without flushing the superblock).
 /// A valid directory FST index must be passed and contained files must all be closed.
-static void DeleteDirectoryContents(Superblock* superblock, u16 directory) {
+static void DeleteDirectoryContents(Superblock* superblock, u16 directory,
+                                    AtomicBitmap<0x8000>* verified) {
   const u16 sub = superblock->fst[directory].sub;
   // Traverse the directory
   for (u16 child = sub; child < superblock->fst.size(); child = superblock->fst[child].sib) {
     if (superblock->fst[child].IsDirectory()) {
-      DeleteDirectoryContents(superblock, child);
+      DeleteDirectoryContents(superblock, child, verified);
     } else {
-      DeleteFile(superblock, child);
+      DeleteFile(superblock, child, verified);
     }
   }
 }
@@ -201,6 +287,10 @@ static ResultCode RemoveFstEntryFromChain(Superblock* superblock, u16 parent, u1
 }
 
 ResultCode FileSystemImpl::Delete(Fd fd, const std::string& path) {
+  WIIFS_PROFILE(Delete);
+  std::lock_guard<std::mutex> lock{m_mutex};
+  if (m_read_only)
+    return ResultCode::ReadOnly;
   const Handle* handle = GetHandleFromFd(fd);
   if (!handle || !IsValidNonRootPath(path))
     return ResultCode::Invalid;
@@ -223,9 +313,9 @@ ResultCode FileSystemImpl::Delete(Fd fd, const std::string& path) {
 
   const FstEntry& entry = superblock->fst[*index];
   if (entry.IsDirectory() && !IsDirectoryInUse(*superblock, *index))
-    DeleteDirectoryContents(superblock, *index);
+    DeleteDirectoryContents(superblock, *index, &m_verified_clusters);
   else if (entry.IsFile() && !IsFileOpened(*index))
-    DeleteFile(superblock, *index);
+    DeleteFile(superblock, *index, &m_verified_clusters);
   else
     return ResultCode::InUse;
 
@@ -237,6 +327,10 @@ ResultCode FileSystemImpl::Delete(Fd fd, const std::string& path) {
 }
 
 ResultCode FileSystemImpl::Rename(Fd fd, const std::string& old_path, const std::string& new_path) {
+  WIIFS_PROFILE(Rename);
+  std::lock_guard<std::mutex> lock{m_mutex};
+  if (m_read_only)
+    return ResultCode::ReadOnly;
   const Handle* handle = GetHandleFromFd(fd);
   if (!handle || !IsValidNonRootPath(old_path) || !IsValidNonRootPath(new_path))
     return ResultCode::Invalid;
@@ -280,9 +374,9 @@ ResultCode FileSystemImpl::Rename(Fd fd, const std::string& old_path, const std:
       return ResultCode::Invalid;
 
     if (superblock->fst[*new_index].IsDirectory() && !IsDirectoryInUse(*superblock, *new_index))
-      DeleteDirectoryContents(superblock, *new_index);
+      DeleteDirectoryContents(superblock, *new_index, &m_verified_clusters);
     else if (superblock->fst[*new_index].IsFile() && !IsFileOpened(*new_index))
-      DeleteFile(superblock, *new_index);
+      DeleteFile(superblock, *new_index, &m_verified_clusters);
     else
       return ResultCode::InUse;
 
@@ -297,6 +391,9 @@ ResultCode FileSystemImpl::Rename(Fd fd, const std::string& old_path, const std:
     return remove_result;
 
   entry->mode = saved_mode;
+  // The data HMACs depend on the file name, so earlier checks no longer apply.
+  if (entry->IsFile())
+    InvalidateVerifiedClusters(*superblock, *index);
   entry->SetName(split_new_path.file_name);
   entry->sib = superblock->fst[*new_parent].sub;
   superblock->fst[*new_parent].sub = *index;
@@ -304,8 +401,22 @@ ResultCode FileSystemImpl::Rename(Fd fd, const std::string& old_path, const std:
   return FlushSuperblock();
 }
 
-Result<std::vector<std::string>> FileSystemImpl::ReadDirectory(Fd fd, const std::string& path) {
-  const Handle* handle = GetHandleFromFd(fd);
+static Metadata GetMetadataFromEntry(const Superblock& superblock, u16 index) {
+  Metadata metadata;
+  metadata.gid = superblock.fst[index].gid;
+  metadata.uid = superblock.fst[index].uid;
+  metadata.attribute = superblock.fst[index].attr;
+  metadata.owner_mode = superblock.fst[index].GetOwnerMode();
+  metadata.group_mode = superblock.fst[index].GetGroupMode();
+  metadata.other_mode = superblock.fst[index].GetOtherMode();
+  metadata.is_file = superblock.fst[index].IsFile();
+  metadata.fst_index = index;
+  metadata.size = superblock.fst[index].size;
+  return metadata;
+}
+
+ResultCode FileSystemImpl::ListDirectory(const Handle* handle, const std::string& path,
+                                         const DirectoryCallback& callback) {
   if (!handle || path.empty() || path.length() > 64 || path[0] != '/')
     return ResultCode::Invalid;
 
@@ -317,20 +428,136 @@ Result<std::vector<std::string>> FileSystemImpl::ReadDirectory(Fd fd, const std:
   if (!index)
     return ResultCode::NotFound;
 
-  if (!HasPermission(superblock->fst[*index], handle->uid, handle->gid, FileMode::Read))
+  return ListDirectory(*superblock, handle, *index, callback);
+}
+
+ResultCode FileSystemImpl::ListDirectory(const Superblock& superblock, const Handle* handle,
+                                         u16 index, const DirectoryCallback& callback) {
+  if (!HasPermission(superblock.fst[index], handle->uid, handle->gid, FileMode::Read))
     return ResultCode::AccessDenied;
 
-  if (!superblock->fst[*index].IsDirectory())
+  if (!superblock.fst[index].IsDirectory())
     return ResultCode::Invalid;
 
+  // Permissions only need to be checked once for the whole directory, since reading metadata
+  // for a child only requires read access to its parent.
+  const u16 sub = superblock.fst[index].sub;
+  for (u16 i = sub; i < superblock.fst.size(); i = superblock.fst[i].sib)
+    callback(superblock.fst[i].GetNameView(), GetMetadataFromEntry(superblock, i));
+  return ResultCode::Success;
+}
+
+Result<std::vector<std::string>> FileSystemImpl::ReadDirectory(Fd fd, const std::string& path) {
+  WIIFS_PROFILE(ReadDirectory);
+  std::lock_guard<std::mutex> lock{m_mutex};
   std::vector<std::string> children;
-  for (u16 i = superblock->fst[*index].sub; i != 0xffff; i = superblock->fst[i].sib) {
-    children.emplace_back(superblock->fst[i].GetName());
-  }
+  const ResultCode result =
+      ListDirectory(GetHandleFromFd(fd), path,
+                    [&](std::string_view name, const Metadata&) { children.emplace_back(name); });
+  if (result != ResultCode::Success)
+    return result;
+  return children;
+}
+
+Result<std::vector<DirectoryEntry>> FileSystemImpl::ReadDirectoryPlus(Fd fd,
+                                                                      const std::string& path) {
+  WIIFS_PROFILE(ReadDirectoryPlus);
+  std::lock_guard<std::mutex> lock{m_mutex};
+  std::vector<DirectoryEntry> children;
+  const ResultCode result = ListDirectory(
+      GetHandleFromFd(fd), path, [&](std::string_view name, const Metadata& metadata) {
+        children.push_back({std::string(name), metadata});
+      });
+  if (result != ResultCode::Success)
+    return result;
   return children;
 }
 
+ResultCode FileSystemImpl::ReadDirectoryPlus(Fd fd, const std::string& path,
+                                             const DirectoryCallback& callback) {
+  WIIFS_PROFILE(ReadDirectoryPlus);
+  std::lock_guard<std::mutex> lock{m_mutex};
+  return ListDirectory(GetHandleFromFd(fd), path, callback);
+}
+
+ResultCode FileSystemImpl::Walk(Fd fd, const std::string& path, const WalkVisitor& visitor) {
+  WIIFS_PROFILE(Walk);
+  std::lock_guard<std::mutex> lock{m_mutex};
+  const Handle* handle = GetHandleFromFd(fd);
+  if (!handle || path.empty() || path.length() > 64 || path[0] != '/')
+    return ResultCode::Invalid;
+
+  const auto* superblock = GetSuperblock();
+  if (!superblock)
+    return ResultCode::SuperblockInitFailed;
+
+  const Result<u16> root = GetFstIndex(*superblock, path);
+  if (!root)
+    return ResultCode::NotFound;
+
+  if (!HasPermission(superblock->fst[*root], handle->uid, handle->gid, FileMode::Read))
+    return ResultCode::AccessDenied;
+
+  if (!superblock->fst[*root].IsDirectory())
+    return ResultCode::Invalid;
+
+  // Depth-first traversal of the sub/sib links, using an explicit stack.
+  // The relative path is kept in a single buffer which is truncated when moving back up.
+  struct Frame {
+    u16 next;
+    size_t path_length;
+    u32 depth;
+  };
+  std::vector<Frame> stack{{superblock->fst[*root].sub, 0, 1}};
+  std::string relative_path;
+  size_t visited = 0;
+
+  while (!stack.empty()) {
+    Frame& frame = stack.back();
+    if (frame.next >= superblock->fst.size()) {
+      stack.pop_back();
+      continue;
+    }
+
+    // A valid tree cannot have more entries than the FST; anything else means there is a loop.
+    if (++visited > superblock->fst.size()) {
+      DebugLog("Error: Walk: cycle detected in the FST\n");
+      return ResultCode::CheckFailed;
+    }
+
+    const u16 index = frame.next;
+    const FstEntry& entry = superblock->fst[index];
+    const u32 depth = frame.depth;
+    frame.next = entry.sib;
+
+    relative_path.resize(frame.path_length);
+    if (frame.path_length != 0)
+      relative_path += '/';
+    relative_path += entry.GetNameView();
+
+    WalkEntry walk_entry;
+    walk_entry.path = relative_path;
+    walk_entry.metadata = GetMetadataFromEntry(*superblock, index);
+    walk_entry.cluster_count =
+        entry.IsFile() ? (u32(entry.size) + CLUSTER_DATA_SIZE - 1) / CLUSTER_DATA_SIZE : 0;
+    walk_entry.depth = depth;
+
+    const WalkAction action = visitor(walk_entry);
+    if (action == WalkAction::Stop)
+      return ResultCode::Success;
+
+    // Like ReadDirectory, listing a directory's children requires read access to it.
+    if (entry.IsDirectory() && action != WalkAction::SkipChildren &&
+        HasPermission(entry, handle->uid, handle->gid, FileMode::Read)) {
+      stack.push_back({entry.sub, relative_path.size(), depth + 1});
+    }
+  }
+  return ResultCode::Success;
+}
+
 Result<Metadata> FileSystemImpl::GetMetadata(Fd fd, const std::string& path) {
+  WIIFS_PROFILE(GetMetadata);
+  std::lock_guard<std::mutex> lock{m_mutex};
   const Handle* handle = GetHandleFromFd(fd);
   if (!handle || path.empty())
     return ResultCode::Invalid;
@@ -360,22 +587,63 @@ Result<Metadata> FileSystemImpl::GetMetadata(Fd fd, const std::string& path) {
     return ResultCode::Invalid;
   }
 
-  Metadata metadata;
-  metadata.gid = superblock->fst[index].gid;
-  metadata.uid = superblock->fst[index].uid;
-  metadata.attribute = superblock->fst[index].attr;
-  metadata.owner_mode = superblock->fst[index].GetOwnerMode();
-  metadata.group_mode = superblock->fst[index].GetGroupMode();
-  metadata.other_mode = superblock->fst[index].GetOtherMode();
-  metadata.is_file = superblock->fst[index].IsFile();
-  metadata.fst_index = index;
-  metadata.size = superblock->fst[index].size;
-  return metadata;
+  return GetMetadataFromEntry(*superblock, index);
+}
+
+Result<std::vector<std::string>> FileSystemImpl::ReadDirectoryByIndex(Fd fd, u16 fst_index) {
+  WIIFS_PROFILE(ReadDirectoryByIndex);
+  std::lock_guard<std::mutex> lock{m_mutex};
+  const Handle* handle = GetHandleFromFd(fd);
+  if (!handle)
+    return ResultCode::Invalid;
+
+  const auto* superblock = GetSuperblock();
+  if (!superblock)
+    return ResultCode::SuperblockInitFailed;
+
+  if (!GetParentIndex(*superblock, fst_index))
+    return ResultCode::NotFound;
+
+  std::vector<std::string> children;
+  const ResultCode result =
+      ListDirectory(*superblock, handle, fst_index,
+                    [&](std::string_view name, const Metadata&) { children.emplace_back(name); });
+  if (result != ResultCode::Success)
+    return result;
+  return children;
+}
+
+Result<Metadata> FileSystemImpl::GetMetadataByIndex(Fd fd, u16 fst_index) {
+  WIIFS_PROFILE(GetMetadataByIndex);
+  std::lock_guard<std::mutex> lock{m_mutex};
+  const Handle* handle = GetHandleFromFd(fd);
+  if (!handle)
+    return ResultCode::Invalid;
+
+  const auto* superblock = GetSuperblock();
+  if (!superblock)
+    return ResultCode::SuperblockInitFailed;
+
+  const std::optional<u16> parent = GetParentIndex(*superblock, fst_index);
+  if (!parent)
+    return ResultCode::NotFound;
+
+  // Same check as GetMetadata: reading metadata requires read access to the parent.
+  if (fst_index != 0 &&
+      !HasPermission(superblock->fst[*parent], handle->uid, handle->gid, FileMode::Read)) {
+    return ResultCode::AccessDenied;
+  }
+
+  return GetMetadataFromEntry(*superblock, fst_index);
 }
 
 ResultCode FileSystemImpl::SetMetadata(Fd fd, const std::string& path, Uid uid, Gid gid,
                                        FileAttribute attribute, FileMode owner_mode,
                                        FileMode group_mode, FileMode other_mode) {
+  WIIFS_PROFILE(SetMetadata);
+  std::lock_guard<std::mutex> lock{m_mutex};
+  if (m_read_only)
+    return ResultCode::ReadOnly;
   const Handle* handle = GetHandleFromFd(fd);
   if (!handle || path.empty() || path.length() > 64 || path[0] != '/')
     return ResultCode::Invalid;
@@ -399,6 +667,8 @@ ResultCode FileSystemImpl::SetMetadata(Fd fd, const std::string& path, Uid uid,
   if (current_entry->IsFile() && current_entry->size != 0)
     return ResultCode::FileNotEmpty;
 
+  if (current_entry->IsFile())
+    InvalidateVerifiedClusters(*superblock, *index);
   current_entry->gid = gid;
   current_entry->uid = uid;
   current_entry->attr = attribute;
@@ -408,6 +678,8 @@ ResultCode FileSystemImpl::SetMetadata(Fd fd, const std::string& path, Uid uid,
 }
 
 Result<NandStats> FileSystemImpl::GetNandStats(Fd fd) {
+  WIIFS_PROFILE(GetNandStats);
+  std::lock_guard<std::mutex> lock{m_mutex};
   const Handle* handle = GetHandleFromFd(fd);
   if (!handle)
     return ResultCode::Invalid;
@@ -423,6 +695,7 @@ Result<NandStats> FileSystemImpl::GetNandStats(Fd fd) {
   NandStats stats{};
 
   stats.cluster_size = CLUSTER_DATA_SIZE;
+  Count(m_perf.fat_scans);
   for (const u16 cluster : superblock->fat) {
     switch (cluster) {
     case CLUSTER_UNUSED:
@@ -471,6 +744,8 @@ static DirectoryStats CountDirectoryRecursively(const Superblock& superblock, u1
 }
 
 Result<DirectoryStats> FileSystemImpl::GetDirectoryStats(Fd fd, const std::string& path) {
+  WIIFS_PROFILE(GetDirectoryStats);
+  std::lock_guard<std::mutex> lock{m_mutex};
   const Handle* handle = GetHandleFromFd(fd);
   if (!handle)
     return ResultCode::Invalid;
@@ -5,33 +5,52 @@
 #pragma once
 
 #include <array>
+#include <condition_variable>
 #include <memory>
+#include <mutex>
+#include <optional>
 #include <string>
+#include <thread>
 #include <vector>
 
+#include "common/atomic_bitmap.h"
 #include "common/common_types.h"
 #include "common/crypto.h"
+#include "common/thread_pool.h"
+#include "driver/perf.h"
 #include "driver/sffs.h"
 #include "wiifs/fs.h"
 #include "wiifs/result.h"
+#include "wiifs/storage.h"
 
 namespace wiifs {
 
 class FileSystemImpl final : public FileSystem {
 public:
-  FileSystemImpl(u8* nand_bytes, const FileSystemKeys& keys);
+  FileSystemImpl(std::unique_ptr<Storage> storage, const FileSystemKeys& keys,
+                 const FileSystemOptions& options, bool read_only);
+  ~FileSystemImpl() override;
 
   ResultCode Format(Uid uid) override;
+  ResultCode Sync() override;
+  CommitToken GetCommitToken() override;
+  ResultCode WaitForCommit(CommitToken token) override;
 
   Result<Fd> OpenFs(Uid uid, Gid gid) override;
   Result<Fd> OpenFile(Uid uid, Gid gid, const std::string& path, FileMode mode) override;
+  Result<Fd> OpenFileByIndex(Uid uid, Gid gid, u16 fst_index, FileMode mode) override;
 
   ResultCode Close(Fd fd) override;
 
   Result<u32> ReadFile(Fd fd, u8* ptr, u32 size) override;
   Result<u32> WriteFile(Fd fd, const u8* ptr, u32 size) override;
+  Result<u32> ReadFileAt(Fd fd, u32 offset, u8* ptr, u32 size) override;
+  Result<u32> WriteFileAt(Fd fd, u32 offset, const u8* ptr, u32 size) override;
+  Result<u32> ReadFileV(Fd fd, const std::vector<IoSegment>& segments) override;
+  Result<u32> WriteFileV(Fd fd, const std::vector<ConstIoSegment>& segments) override;
   Result<u32> SeekFile(Fd fd, std::uint32_t offset, SeekMode mode) override;
   Result<FileStatus> GetFileStatus(Fd fd) override;
+  ResultCode Preallocate(Fd fd, u32 size) override;
 
   ResultCode CreateFile(Fd fd, const std::string& path, FileAttribute attribute,
                         FileMode owner_mode, FileMode group_mode, FileMode other_mode) override;
@@ -44,13 +63,29 @@ public:
   ResultCode Rename(Fd fd, const std::string& old_path, const std::string& new_path) override;
 
   Result<std::vector<std::string>> ReadDirectory(Fd fd, const std::string& path) override;
+  Result<std::vector<DirectoryEntry>> ReadDirectoryPlus(Fd fd, const std::string& path) override;
+  ResultCode ReadDirectoryPlus(Fd fd, const std::string& path,
+                               const DirectoryCallback& callback) override;
+  ResultCode Walk(Fd fd, const std::string& path, const WalkVisitor& visitor) override;
+
+  Result<std::vector<std::string>> ReadDirectoryByIndex(Fd fd, u16 fst_index) override;
 
   Result<Metadata> GetMetadata(Fd fd, const std::string& path) override;
+  Result<Metadata> GetMetadataByIndex(Fd fd, u16 fst_index) override;
   ResultCode SetMetadata(Fd fd, const std::string& path, Uid uid, Gid gid, FileAttribute attribute,
                          FileMode owner_mode, FileMode group_mode, FileMode other_mode) override;
 
   Result<NandStats> GetNandStats(Fd fd) override;
   Result<DirectoryStats> GetDirectoryStats(Fd fd, const std::string& path) override;
+  PerfCounters GetPerfCounters() override;
+  std::vector<LatencyHistogram> GetLatencyHistograms() override;
+  ResultCode StartTracing(size_t max_events) override;
+  ResultCode StopTracing(const std::string& path) override;
+
+  Result<ScrubReport> Scrub(Fd fd, const ScrubProgressCallback& progress) override;
+  Result<CheckReport> Check(Fd fd, bool repair) override;
+  Result<FragmentationReport> GetFragmentationReport(Fd fd) override;
+  Result<DefragmentReport> Defragment(Fd fd, u32 max_clusters) override;
 
 private:
   struct Handle {
@@ -62,6 +97,11 @@ private:
     u32 file_offset = 0;
     u32 file_size = 0;
     bool superblock_flush_needed = false;
+    /// Clusters reserved by Preallocate: chain index i goes to cluster
+    /// reserved_cluster + (i - reserved_chain_index), if that cluster is still reserved.
+    u16 reserved_chain_index = 0;
+    u16 reserved_cluster = 0;
+    u16 reserved_count = 0;
   };
   Handle* AssignFreeHandle(Uid uid, Gid gid);
   Handle* GetHandleFromFd(Fd fd);
@@ -73,6 +113,16 @@ private:
   /// A valid directory FST index must be passed.
   bool IsDirectoryInUse(const Superblock& superblock, u16 directory_index) const;
 
+  /// Open a file that has already been looked up.
+  Result<Fd> OpenFileHandle(const Superblock& superblock, Uid uid, Gid gid, u16 fst_index,
+                            FileMode mode);
+
+  /// Call `callback` for each child of a directory, after checking permissions.
+  ResultCode ListDirectory(const Handle* handle, const std::string& path,
+                           const DirectoryCallback& callback);
+  ResultCode ListDirectory(const Superblock& superblock, const Handle* handle, u16 fst_index,
+                           const DirectoryCallback& callback);
+
   ResultCode CreateFileOrDirectory(const Handle* handle, const std::string& path,
                                    FileAttribute attribute, FileMode owner_mode,
                                    FileMode group_mode, FileMode other_mode, bool is_file);
@@ -88,28 +138,105 @@ private:
     crypto::Hash hmac2;
   };
   Result<ReadResult> ReadCluster(u16 cluster);
+  /// data *must* point to a 0x4000 bytes long buffer.
+  ResultCode ReadCluster(u16 cluster, u8* data, crypto::Hash* hmac1, crypto::Hash* hmac2) const;
+  /// Get the absolute path of a FST entry that is reachable from the root directory.
+  std::string GetPath(const Superblock& superblock, u16 fst_index);
+  /// Extract the data (decrypted if needed) and the HMACs from a raw cluster (CLUSTER_RAW_SIZE).
+  void DecodeCluster(u16 cluster, const u8* raw, u8* data, crypto::Hash* hmac1,
+                     crypto::Hash* hmac2) const;
   Result<Superblock> ReadSuperblock(u16 superblock);
   Result<std::vector<u8>> ReadFileData(u16 fst_index, u16 chain_index);
+  /// Read and verify num_clusters clusters of a file, starting from chain_index.
+  /// Large reads are split across worker threads. On failure, num_read is set to the number of
+  /// clusters (counted from chain_index) that were successfully read before the first bad one.
+  ResultCode ReadFileData(u16 fst_index, u16 chain_index, u32 num_clusters, u8* dest,
+                          u32* num_read);
+  /// Read and verify a file cluster whose physical location is already known.
+  /// This does not touch any mutable state and can be called from worker threads.
+  ResultCode ReadFileCluster(const Superblock& superblock, u16 fst_index, u16 chain_index,
+                             u16 cluster, u8* data) const;
   Superblock* GetSuperblock();
   Result<u16> GetFstIndex(const Superblock& superblock, const std::string& path) const;
   Result<u16> GetFstIndex(const Superblock& superblock, u16 parent, const std::string& file) const;
   Result<u16> GetUnusedFstIndex(const Superblock& superblock) const;
+  /// Get the FST index of the directory that contains an entry (0 for the root itself).
+  /// Returns nothing if the entry is unused or cannot be reached from the root.
+  std::optional<u16> GetParentIndex(const Superblock& superblock, u16 fst_index);
+
+  /// Take the cluster that was reserved for a chain index of a file, if there is one.
+  std::optional<u16> TakeReservedCluster(u16 fst_index, u32 chain_index);
+  /// Release the clusters that a handle has reserved and not used yet.
+  void ReleaseReservation(Handle* handle);
 
   /// Write 0x4000 bytes of data to the NAND.
   ResultCode WriteCluster(u16 cluster, const u8* data, const crypto::Hash& hmac);
   ResultCode WriteFileData(u16 fst_index, const u8* data, u16 chain_index, u32 new_size);
-  /// Write a new superblock to the NAND to persist changes that were made to metadata.
+  /// Write num_clusters clusters (0x4000 bytes each) of file data starting from chain_index.
+  /// Clusters are allocated and linked in order, but large writes are encrypted, MAC'd and
+  /// ECC'd by several worker threads.
+  ResultCode WriteFileData(u16 fst_index, const u8* data, u16 chain_index, u32 num_clusters,
+                           u32 new_size);
+  /// Persist changes that were made to metadata. With async commits, this only schedules
+  /// a commit; otherwise, a new superblock is written to the NAND right away.
   ResultCode FlushSuperblock();
+  /// Write a superblock to the next slot after bumping its version.
+  ResultCode WriteSuperblock(Superblock* superblock);
+  /// Wait until the state identified by `token` has been written to the NAND.
+  ResultCode WaitForCommit(std::unique_lock<std::mutex>& lock, CommitToken token);
+  /// Make the state identified by `token` durable.
+  ResultCode Sync(std::unique_lock<std::mutex>& lock, CommitToken token);
+  /// Background thread for async commits.
+  void CommitThread();
+  /// Make the clusters in [first, end) that were written since the last sync durable.
+  ResultCode FlushDirtyClusters(u16 first, u16 end);
+  /// Forget that the clusters of a file were verified, for when their HMAC salt changes.
+  void InvalidateVerifiedClusters(const Superblock& superblock, u16 fst_index);
+  /// Discard the clusters that were freed by superblocks which are now durable.
+  void DiscardFreedClusters();
 
   /// Flush the file cache.
   ResultCode FlushFileCache();
+  /// Flush and drop the file cache if it holds data for the specified file.
+  ResultCode EvictFileCache(u16 fst_index);
   /// Populate the file cache.
   ResultCode PopulateFileCache(Handle* handle, u32 offset, bool write);
 
-  u8* m_nand;
+  /// Read from or write to a file at the specified offset, which is advanced by the number
+  /// of bytes that were processed (even if an error occurs part way).
+  Result<u32> ReadFileAt(Handle* handle, u32* offset, u8* ptr, u32 count);
+  Result<u32> WriteFileAt(Handle* handle, u32* offset, const u8* ptr, u32 count);
+
+  /// Minimum number of clusters for a read or write to be split across worker threads.
+  static constexpr u32 PARALLEL_MIN_CLUSTERS = 4;
+  ThreadPool& GetThreadPool();
+
+  /// Serialises all public member functions.
+  std::mutex m_mutex;
+
+  std::unique_ptr<Storage> m_storage;
+  FileSystemOptions m_options;
+  /// Whether the file system was mounted read-only. Nothing is ever written if set.
+  bool m_read_only;
+  /// Clusters whose HMAC has been checked against their current salt (lazy verification).
+  /// A bit is cleared whenever the cluster is written or freed, or when the metadata of the
+  /// owning file that is part of the salt (uid, name) changes.
+  mutable AtomicBitmap<0x8000> m_verified_clusters;
+  /// Free clusters that have been reserved by Preallocate. They are skipped by the allocator.
+  AtomicBitmap<0x8000> m_reserved_clusters;
+  /// Clusters that have been written to the storage but not flushed yet.
+  AtomicBitmap<0x8000> m_dirty_clusters;
   FileSystemKeys m_keys;
   std::unique_ptr<Superblock> m_superblock;
   u32 m_superblock_index = 0;
+  /// FAT of the last superblock that was written to the storage (or is being written).
+  /// Clusters that it references are never reused, so that it stays valid.
+  decltype(Superblock::fat) m_committed_fat;
+  /// FAT of the last superblock that is known to be durable. Clusters that it references
+  /// must not be discarded, since that superblock is used if the next one is lost.
+  decltype(Superblock::fat) m_synced_fat;
+  /// Parent FST index for each FST entry. Built on demand; empty when invalidated.
+  std::vector<u16> m_fst_parents;
   std::array<Handle, 16> m_handles{};
   Handle m_internal_handle{true};
 
@@ -117,6 +244,33 @@ private:
   u16 m_cache_chain_index = 0xffff;
   std::vector<u8> m_cache_data;
   bool m_cache_for_write = false;
+
+  std::unique_ptr<ThreadPool> m_thread_pool;
+
+  /// Updated from const member functions and worker threads as well.
+  mutable PerfCounterSet m_perf;
+#ifdef WIIFS_PROFILING
+  mutable Profiler m_profiler;
+#endif
+
+  /// State of the in-memory metadata. Incremented by every FlushSuperblock.
+  CommitToken m_change_token = 0;
+  /// Most recent state whose commit has been started.
+  CommitToken m_commit_token = 0;
+  /// Most recent state that has been written to the NAND.
+  CommitToken m_committed_token = 0;
+  bool m_commit_in_progress = false;
+  bool m_commit_requested = false;
+  bool m_stop_commit_thread = false;
+  ResultCode m_commit_error = ResultCode::Success;
+  /// Wakes up the commit thread.
+  std::condition_variable m_commit_cv;
+  /// Signalled whenever a commit finishes.
+  std::condition_variable m_commit_done_cv;
+  /// Copy of the superblock that the commit thread is writing, so that the metadata can keep
+  /// changing in the meantime.
+  std::unique_ptr<Superblock> m_commit_snapshot;
+  std::thread m_commit_thread;
 };
 
 }  // namespace wiifs
@@ -6,8 +6,10 @@
 
 #include <algorithm>
 #include <array>
+#include <cstddef>
 #include <cstring>
 #include <optional>
+#include <utility>
 
 #include "common/align.h"
 #include "common/crypto.h"
@@ -19,6 +21,7 @@ namespace wiifs {
 
 crypto::Hash FileSystemImpl::GenerateHmacForSuperblock(const Superblock& superblock,
                                                        u16 index) const {
+  Count(m_perf.hmacs_computed);
   SuperblockSalt salt{};
   salt.starting_cluster = SuperblockCluster(index);
   crypto::BlockMacGenerator mac_generator{m_keys.hmac};
@@ -30,6 +33,8 @@ crypto::Hash FileSystemImpl::GenerateHmacForSuperblock(const Superblock& superbl
 crypto::Hash FileSystemImpl::GenerateHmacForData(const Superblock& superblock,
                                                  const u8* cluster_data, u16 fst_index,
                                                  u16 chain_index) const {
+  WIIFS_PROFILE(GenerateHmacForData);
+  Count(m_perf.hmacs_computed);
   const FstEntry& entry = superblock.fst.at(fst_index);
   DataSalt salt{};
   salt.uid = entry.uid;
@@ -45,52 +50,72 @@ crypto::Hash FileSystemImpl::GenerateHmacForData(const Superblock& superblock,
 }
 
 Result<FileSystemImpl::ReadResult> FileSystemImpl::ReadCluster(u16 cluster) {
+  ReadResult result;
+  result.data.resize(CLUSTER_DATA_SIZE);
+  const ResultCode code = ReadCluster(cluster, result.data.data(), &result.hmac1, &result.hmac2);
+  if (code != ResultCode::Success)
+    return code;
+  return result;
+}
+
+ResultCode FileSystemImpl::ReadCluster(u16 cluster, u8* data, crypto::Hash* hmac1,
+                                       crypto::Hash* hmac2) const {
+  WIIFS_PROFILE(ReadCluster);
   if (cluster >= 0x8000)
     return ResultCode::Invalid;
 
   DebugLog("Reading cluster 0x%04x\n", cluster);
-  std::vector<u8> result;
+  std::array<u8, CLUSTER_RAW_SIZE> raw;
+  const ResultCode result = m_storage->ReadPages(PageIndex(cluster), PAGES_PER_CLUSTER, raw.data());
+  if (result != ResultCode::Success)
+    return result;
+  Count(m_perf.clusters_read);
+
+  DecodeCluster(cluster, raw.data(), data, hmac1, hmac2);
+  return ResultCode::Success;
+}
+
+void FileSystemImpl::DecodeCluster(u16 cluster, const u8* raw, u8* data, crypto::Hash* hmac1,
+                                   crypto::Hash* hmac2) const {
   for (u32 page = 0; page < PAGES_PER_CLUSTER; ++page) {
-    result.insert(result.end(), &m_nand[Offset(cluster, page)],
-                  &m_nand[Offset(cluster, page)] + DATA_BYTES_PER_PAGE);
+    std::copy_n(&raw[page * PAGE_SIZE], DATA_BYTES_PER_PAGE, data + page * DATA_BYTES_PER_PAGE);
   }
 
   if (cluster < SUPERBLOCK_START_CLUSTER) {
     std::array<u8, 16> iv{};
-    result = crypto::AesDecrypt(m_keys.aes.data(), iv.data(), result.data(), result.size());
+    crypto::AesDecrypt(m_keys.aes.data(), iv.data(), data, data, CLUSTER_DATA_SIZE);
+    Count(m_perf.bytes_decrypted, CLUSTER_DATA_SIZE);
   }
 
-  crypto::Hash hmac1;
-  std::copy_n(&m_nand[Offset(cluster, HMAC_PAGE1)] + DATA_BYTES_PER_PAGE + HMAC1_OFFSET_IN_PAGE1,
-              HMAC1_SIZE_IN_PAGE1, hmac1.begin());
-
-  crypto::Hash hmac2;
-  std::copy_n(&m_nand[Offset(cluster, HMAC_PAGE1)] + DATA_BYTES_PER_PAGE + HMAC2_OFFSET_IN_PAGE1,
-              HMAC2_SIZE_IN_PAGE1, hmac2.begin());
-  std::copy_n(&m_nand[Offset(cluster, HMAC_PAGE2)] + DATA_BYTES_PER_PAGE + HMAC2_OFFSET_IN_PAGE2,
-              HMAC2_SIZE_IN_PAGE2, hmac2.begin() + HMAC2_SIZE_IN_PAGE1);
+  const u8* spare1 = &raw[HMAC_PAGE1 * PAGE_SIZE + DATA_BYTES_PER_PAGE];
+  const u8* spare2 = &raw[HMAC_PAGE2 * PAGE_SIZE + DATA_BYTES_PER_PAGE];
+  std::copy_n(spare1 + HMAC1_OFFSET_IN_PAGE1, HMAC1_SIZE_IN_PAGE1, hmac1->begin());
 
-  return ReadResult{result, hmac1, hmac2};
+  std::copy_n(spare1 + HMAC2_OFFSET_IN_PAGE1, HMAC2_SIZE_IN_PAGE1, hmac2->begin());
+  std::copy_n(spare2 + HMAC2_OFFSET_IN_PAGE2, HMAC2_SIZE_IN_PAGE2,
+              hmac2->begin() + HMAC2_SIZE_IN_PAGE1);
 }
 
 ResultCode FileSystemImpl::WriteCluster(u16 cluster, const u8* data, const crypto::Hash& hmac) {
+  WIIFS_PROFILE(WriteCluster);
+  if (m_read_only)
+    return ResultCode::ReadOnly;
+
   if (cluster >= 0x8000)
     return ResultCode::Invalid;
 
   DebugLog("Writing to cluster 0x%04x\n", cluster);
+  std::array<u8, CLUSTER_RAW_SIZE> raw;
   std::array<u8, 16> iv{};
   for (u32 page = 0; page < PAGES_PER_CLUSTER; ++page) {
     const u8* source = &data[page * DATA_BYTES_PER_PAGE];
-    u8* dest = &m_nand[Offset(cluster, page)];
+    u8* dest = &raw[page * PAGE_SIZE];
 
     // Write the page data.
-    if (cluster >= SUPERBLOCK_START_CLUSTER) {
+    if (cluster >= SUPERBLOCK_START_CLUSTER)
       std::copy_n(source, DATA_BYTES_PER_PAGE, dest);
-    } else {
-      const auto encrypted_source =
-          crypto::AesEncrypt(m_keys.aes.data(), iv.data(), source, DATA_BYTES_PER_PAGE);
-      std::copy(encrypted_source.begin(), encrypted_source.end(), dest);
-    }
+    else
+      crypto::AesEncrypt(m_keys.aes.data(), iv.data(), source, dest, DATA_BYTES_PER_PAGE);
 
     // Write the spare data (ECC / HMAC).
     std::array<u8, 0x40> spare{};
@@ -111,7 +136,82 @@ ResultCode FileSystemImpl::WriteCluster(u16 cluster, const u8* data, const crypt
     std::copy(spare.begin(), spare.end(), dest + DATA_BYTES_PER_PAGE);
   }
 
-  return ResultCode::Success;
+  if (cluster < SUPERBLOCK_START_CLUSTER)
+    Count(m_perf.bytes_encrypted, CLUSTER_DATA_SIZE);
+  Count(m_perf.ecc_computations, PAGES_PER_CLUSTER);
+
+  m_verified_clusters.Clear(cluster);
+  const ResultCode result =
+      m_storage->WritePages(PageIndex(cluster), PAGES_PER_CLUSTER, raw.data());
+  if (result == ResultCode::Success) {
+    m_dirty_clusters.Set(cluster);
+    Count(m_perf.clusters_written);
+  }
+  return result;
+}
+
+ResultCode FileSystemImpl::FlushDirtyClusters(u16 first, u16 end) {
+  std::vector<PageRange> ranges;
+  for (u32 cluster = first; cluster < end; ++cluster) {
+    if (!m_dirty_clusters.TestAndClear(cluster))
+      continue;
+    if (!ranges.empty() && ranges.back().first_page + ranges.back().count == PageIndex(cluster))
+      ranges.back().count += PAGES_PER_CLUSTER;
+    else
+      ranges.push_back({PageIndex(cluster), PAGES_PER_CLUSTER});
+  }
+
+  const ResultCode result = m_storage->Flush(ranges);
+  if (result != ResultCode::Success) {
+    // Keep the clusters marked as dirty so that the next sync tries again.
+    for (const PageRange& range : ranges) {
+      for (u32 page = range.first_page; page < range.first_page + range.count;
+           page += PAGES_PER_CLUSTER) {
+        m_dirty_clusters.Set(page / PAGES_PER_CLUSTER);
+      }
+    }
+  }
+  return result;
+}
+
+void FileSystemImpl::InvalidateVerifiedClusters(const Superblock& superblock, u16 fst_index) {
+  // Bounded so that a corrupted (looping) chain cannot hang.
+  u16 cluster = superblock.fst[fst_index].sub;
+  for (size_t i = 0; i < superblock.fat.size() && cluster < superblock.fat.size(); ++i) {
+    m_verified_clusters.Clear(cluster);
+    cluster = superblock.fat[cluster];
+  }
+}
+
+static bool IsClusterInUse(u16 value) {
+  return value != CLUSTER_UNUSED && value != 0xffff && value != CLUSTER_RESERVED &&
+         value != CLUSTER_BAD_BLOCK;
+}
+
+void FileSystemImpl::DiscardFreedClusters() {
+  if (!m_superblock || !m_storage->CanDiscard())
+    return;
+
+  // A cluster can only be discarded once no durable superblock references it anymore.
+  // It must also still be free in memory, as it may have been reused since the last commit.
+  std::vector<PageRange> ranges;
+  for (u32 cluster = 0; cluster < SUPERBLOCK_START_CLUSTER; ++cluster) {
+    if (!IsClusterInUse(m_synced_fat[cluster]) || m_committed_fat[cluster] != CLUSTER_UNUSED ||
+        m_superblock->fat[cluster] != CLUSTER_UNUSED) {
+      continue;
+    }
+    if (!ranges.empty() && ranges.back().first_page + ranges.back().count == PageIndex(cluster))
+      ranges.back().count += PAGES_PER_CLUSTER;
+    else
+      ranges.push_back({PageIndex(cluster), PAGES_PER_CLUSTER});
+  }
+
+  // Discarding is only an optimisation, so failures are not fatal.
+  if (m_storage->Discard(ranges) != ResultCode::Success) {
+    DebugLog("Warning: Failed to discard freed clusters\n");
+    return;
+  }
+  m_synced_fat = m_committed_fat;
 }
 
 static std::optional<u16> GetClusterForFile(const Superblock& superblock, const u16 first_cluster,
@@ -132,59 +232,141 @@ static std::optional<u16> GetClusterForFile(const Superblock& superblock, const
 
 ResultCode FileSystemImpl::WriteFileData(u16 fst_index, const u8* source, u16 chain_index,
                                          u32 new_size) {
-  DebugLog("Writing to file 0x%04x chain_index %u\n", fst_index, chain_index);
-  if (fst_index >= std::tuple_size<decltype(Superblock::fst)>::value)
+  return WriteFileData(fst_index, source, chain_index, 1, new_size);
+}
+
+ResultCode FileSystemImpl::WriteFileData(u16 fst_index, const u8* source, u16 chain_index,
+                                         u32 num_clusters, u32 new_size) {
+  DebugLog("Writing to file 0x%04x chain_index %u (%u clusters)\n", fst_index, chain_index,
+           num_clusters);
+  if (fst_index >= std::tuple_size<decltype(Superblock::fst)>::value || num_clusters == 0)
     return ResultCode::Invalid;
 
   auto* superblock = GetSuperblock();
   if (!superblock)
     return ResultCode::SuperblockInitFailed;
 
+  // Clusters within the file are replaced (new_size == entry.size for overwrites);
+  // a file can never shrink here.
   FstEntry& entry = superblock->fst[fst_index];
-  if (!entry.IsFile() || new_size <= entry.size)
+  if (!entry.IsFile() || new_size < entry.size)
     return ResultCode::Invalid;
 
   // Currently, clusters are allocated in a very simple way that ignores wear leveling
   // since we are not writing to an actual flash device anyway.
-  const auto it = std::find(superblock->fat.begin(), superblock->fat.end(), CLUSTER_UNUSED);
-  if (it == superblock->fat.end())
-    return ResultCode::NoFreeSpace;
-  const u16 cluster = it - superblock->fat.begin();
-  DebugLog("Found free cluster 0x%04x\n", cluster);
-
-  const auto hash = GenerateHmacForData(*superblock, source, fst_index, chain_index);
-  const auto write_result = WriteCluster(cluster, source, hash);
-  if (write_result != ResultCode::Success)
-    return write_result;
-
-  const std::optional<u16> old_cluster = GetClusterForFile(*superblock, entry.sub, chain_index);
-
-  // Change the previous cluster (or the FST) to point to the new cluster
-  if (chain_index == 0) {
-    entry.sub = cluster;
+  std::vector<u16> clusters(num_clusters);
+  auto it = superblock->fat.begin();
+  for (u32 i = 0; i < num_clusters; ++i) {
+    if (const std::optional<u16> reserved = TakeReservedCluster(fst_index, chain_index + i)) {
+      clusters[i] = *reserved;
+      continue;
+    }
+    // The search resumes where the previous one stopped, so this is a single scan.
+    if (it == superblock->fat.begin())
+      Count(m_perf.fat_scans);
+    it = std::find_if(it, superblock->fat.end(), [&](const BigEndianValue<u16>& value) {
+      const size_t index = &value - superblock->fat.data();
+      return value == CLUSTER_UNUSED && m_committed_fat[index] == CLUSTER_UNUSED &&
+             !m_reserved_clusters.Test(index);
+    });
+    if (it == superblock->fat.end())
+      return ResultCode::NoFreeSpace;
+    clusters[i] = it++ - superblock->fat.begin();
+    DebugLog("Found free cluster 0x%04x\n", clusters[i]);
+  }
+
+  // The HMAC, encryption and ECC of each cluster do not depend on the others,
+  // so for large writes this is split across worker threads.
+  std::vector<ResultCode> results(num_clusters, ResultCode::Success);
+  const auto write_cluster = [&](size_t i) {
+    const u8* data = source + i * CLUSTER_DATA_SIZE;
+    const auto hash = GenerateHmacForData(*superblock, data, fst_index, chain_index + i);
+    results[i] = WriteCluster(clusters[i], data, hash);
+  };
+  if (num_clusters < PARALLEL_MIN_CLUSTERS) {
+    for (size_t i = 0; i < num_clusters; ++i)
+      write_cluster(i);
   } else {
-    const std::optional<u16> prev = GetClusterForFile(*superblock, entry.sub, chain_index - 1);
+    GetThreadPool().ParallelFor(num_clusters, write_cluster);
+  }
+  for (const ResultCode result : results) {
+    if (result != ResultCode::Success)
+      return result;
+  }
+
+  // Now link the new clusters into the chain, in order.
+  std::optional<u16> prev;
+  if (chain_index != 0) {
+    prev = GetClusterForFile(*superblock, entry.sub, chain_index - 1);
     if (!prev)
       return ResultCode::Invalid;
-    superblock->fat[*prev] = cluster;
   }
+  std::optional<u16> old_cluster = GetClusterForFile(*superblock, entry.sub, chain_index);
 
-  // If we are replacing another cluster, keep pointing to the same next cluster
-  if (old_cluster)
-    superblock->fat[cluster] = superblock->fat[*old_cluster];
-  else
-    superblock->fat[cluster] = CLUSTER_LAST_IN_CHAIN;
+  for (const u16 cluster : clusters) {
+    // Change the previous cluster (or the FST) to point to the new cluster
+    if (!prev)
+      entry.sub = cluster;
+    else
+      superblock->fat[*prev] = cluster;
+
+    // If we are replacing another cluster, keep pointing to the same next cluster
+    if (old_cluster)
+      superblock->fat[cluster] = superblock->fat[*old_cluster];
+    else
+      superblock->fat[cluster] = CLUSTER_LAST_IN_CHAIN;
+
+    // Free the old cluster now (unless it was rewritten in place)
+    if (old_cluster && *old_cluster != cluster) {
+      DebugLog("Freeing cluster 0x%04x\n", *old_cluster);
+      superblock->fat[*old_cluster] = CLUSTER_UNUSED;
+      m_verified_clusters.Clear(*old_cluster);
+    }
 
-  // Free the old cluster now
-  if (old_cluster) {
-    DebugLog("Freeing cluster 0x%04x\n", *old_cluster);
-    superblock->fat[*old_cluster] = CLUSTER_UNUSED;
+    prev = cluster;
+    old_cluster = GetClusterForFile(*superblock, cluster, 1);
   }
 
   entry.size = new_size;
   return ResultCode::Success;
 }
 
+std::optional<u16> FileSystemImpl::TakeReservedCluster(u16 fst_index, u32 chain_index) {
+  for (const Handle& handle : m_handles) {
+    if (!handle.opened || handle.fst_index != fst_index ||
+        chain_index < handle.reserved_chain_index ||
+        chain_index - handle.reserved_chain_index >= handle.reserved_count) {
+      continue;
+    }
+    const u16 cluster = handle.reserved_cluster + (chain_index - handle.reserved_chain_index);
+    if (m_reserved_clusters.TestAndClear(cluster))
+      return cluster;
+    // A partial last cluster is rewritten every time the file grows. Rewriting it in place keeps
+    // the file contiguous, and is safe as long as the last written superblock does not use it.
+    if (m_committed_fat[cluster] == CLUSTER_UNUSED &&
+        GetClusterForFile(*m_superblock, m_superblock->fst[fst_index].sub, chain_index) ==
+            cluster) {
+      return cluster;
+    }
+  }
+  return {};
+}
+
+void FileSystemImpl::ReleaseReservation(Handle* handle) {
+  for (u32 i = 0; i < handle->reserved_count; ++i) {
+    const u16 cluster = handle->reserved_cluster + i;
+    // A cluster that was used and freed again may have been reserved by another handle since.
+    const bool reserved_by_other = std::any_of(
+        m_handles.begin(), m_handles.end(), [&](const Handle& other) {
+          return &other != handle && other.opened && cluster >= other.reserved_cluster &&
+                 cluster - other.reserved_cluster < other.reserved_count;
+        });
+    if (!reserved_by_other)
+      m_reserved_clusters.Clear(cluster);
+  }
+  handle->reserved_count = 0;
+}
+
 Result<Superblock> FileSystemImpl::ReadSuperblock(u16 superblock) {
   DebugLog("Reading superblock %u\n", superblock);
   Superblock block;
@@ -201,6 +383,17 @@ Result<Superblock> FileSystemImpl::ReadSuperblock(u16 superblock) {
 }
 
 Result<std::vector<u8>> FileSystemImpl::ReadFileData(u16 fst_index, u16 chain_index) {
+  std::vector<u8> data(CLUSTER_DATA_SIZE);
+  u32 num_read = 0;
+  const ResultCode result = ReadFileData(fst_index, chain_index, 1, data.data(), &num_read);
+  if (result != ResultCode::Success)
+    return result;
+  return data;
+}
+
+ResultCode FileSystemImpl::ReadFileData(u16 fst_index, u16 chain_index, u32 num_clusters,
+                                        u8* dest, u32* num_read) {
+  *num_read = 0;
   if (fst_index >= std::tuple_size<decltype(Superblock::fst)>::value)
     return ResultCode::Invalid;
 
@@ -209,74 +402,167 @@ Result<std::vector<u8>> FileSystemImpl::ReadFileData(u16 fst_index, u16 chain_in
     return ResultCode::SuperblockInitFailed;
 
   const FstEntry& entry = superblock->fst[fst_index];
-  if (!entry.IsFile() || entry.size <= chain_index * CLUSTER_DATA_SIZE)
+  if (!entry.IsFile())
     return ResultCode::Invalid;
 
-  const auto result = ReadCluster(*GetClusterForFile(*superblock, entry.sub, chain_index));
-  if (!result)
-    return result.Error();
+  // Resolve the whole chain range up front so that each cluster can be processed
+  // independently of the others.
+  std::vector<u16> clusters;
+  clusters.reserve(num_clusters);
+  std::optional<u16> cluster = GetClusterForFile(*superblock, entry.sub, chain_index);
+  for (u32 i = 0; i < num_clusters; ++i) {
+    if (entry.size <= (chain_index + i) * CLUSTER_DATA_SIZE || !cluster)
+      break;
+    clusters.push_back(*cluster);
+    cluster = GetClusterForFile(*superblock, *cluster, 1);
+  }
+
+  // AES-CBC uses a zero IV for every cluster and the HMAC salt only depends on the chain index,
+  // so clusters can be decrypted and verified in any order.
+  std::vector<ResultCode> results(clusters.size(), ResultCode::Success);
+  const auto read_cluster = [&](size_t i) {
+    results[i] = ReadFileCluster(*superblock, fst_index, chain_index + i, clusters[i],
+                                 dest + i * CLUSTER_DATA_SIZE);
+  };
+  if (clusters.size() < PARALLEL_MIN_CLUSTERS) {
+    for (size_t i = 0; i < clusters.size(); ++i)
+      read_cluster(i);
+  } else {
+    GetThreadPool().ParallelFor(clusters.size(), read_cluster);
+  }
+
+  // Report the first failure, like a cluster-by-cluster read would.
+  for (const ResultCode result : results) {
+    if (result != ResultCode::Success)
+      return result;
+    ++*num_read;
+  }
+  return *num_read == num_clusters ? ResultCode::Success : ResultCode::Invalid;
+}
+
+ResultCode FileSystemImpl::ReadFileCluster(const Superblock& superblock, u16 fst_index,
+                                           u16 chain_index, u16 cluster, u8* data) const {
+  crypto::Hash hmac1, hmac2;
+  const ResultCode result = ReadCluster(cluster, data, &hmac1, &hmac2);
+  if (result != ResultCode::Success)
+    return result;
 
-  const auto hash = GenerateHmacForData(*superblock, result->data.data(), fst_index, chain_index);
-  if (hash != result->hmac1 && hash != result->hmac2) {
+  if (m_options.verification == VerificationPolicy::Trusted ||
+      (m_options.verification == VerificationPolicy::Lazy && m_verified_clusters.Test(cluster))) {
+    return ResultCode::Success;
+  }
+
+  const auto hash = GenerateHmacForData(superblock, data, fst_index, chain_index);
+  if (hash != hmac1 && hash != hmac2) {
+    Count(m_perf.hmac_failures);
     DebugLog("Error: Failed to verify cluster data (fst_index 0x%04x chain_index %u)\n", fst_index,
              chain_index);
     return ResultCode::CheckFailed;
   }
+  if (m_options.verification == VerificationPolicy::Lazy)
+    m_verified_clusters.Set(cluster);
+  return ResultCode::Success;
+}
 
-  return result->data;
+ThreadPool& FileSystemImpl::GetThreadPool() {
+  if (!m_thread_pool)
+    m_thread_pool = std::make_unique<ThreadPool>(GetDefaultWorkerCount());
+  return *m_thread_pool;
 }
 
 Superblock* FileSystemImpl::GetSuperblock() {
   if (m_superblock)
     return m_superblock.get();
 
-  u32 highest_version = 0;
+  // Only the first cluster of each superblock is needed to find the most recent one,
+  // so that mounting does not require reading every copy in full.
+  std::vector<std::pair<u32, u32>> candidates;
   for (u32 i = 0; i < NUMBER_OF_SUPERBLOCKS; ++i) {
-    const Result<Superblock> superblock = ReadSuperblock(i);
-    if (!superblock || superblock->magic != SUPERBLOCK_MAGIC)
+    const Result<ReadResult> header = ReadCluster(SuperblockCluster(i));
+    if (!header)
+      continue;
+    decltype(Superblock::magic) magic;
+    decltype(Superblock::version) version;
+    std::memcpy(&magic, header->data.data() + offsetof(Superblock, magic), sizeof(magic));
+    std::memcpy(&version, header->data.data() + offsetof(Superblock, version), sizeof(version));
+    if (magic != SUPERBLOCK_MAGIC)
       continue;
+    candidates.emplace_back(version, i);
+  }
 
-    if (superblock->version < highest_version) {
-      DebugLog("Found an older superblock: index %u, version %u\n", i, u32(superblock->version));
+  // Newest first. For equal versions, the superblock with the highest index wins.
+  // A superblock that cannot be read or verified (for example because a crash interrupted its
+  // write) is skipped, so that the previous one is used instead.
+  std::sort(candidates.rbegin(), candidates.rend());
+  for (const auto& [version, index] : candidates) {
+    const Result<Superblock> superblock = ReadSuperblock(index);
+    if (!superblock || superblock->magic != SUPERBLOCK_MAGIC)
       continue;
+
+    if (m_options.verification != VerificationPolicy::Trusted) {
+      const auto hash = GenerateHmacForSuperblock(*superblock, index);
+      const auto read_result = ReadCluster(SuperblockCluster(index) + 15);
+      if (!read_result || (hash != read_result->hmac1 && hash != read_result->hmac2)) {
+        Count(m_perf.hmac_failures);
+        DebugLog("Error: Failed to verify superblock %u\n", index);
+        continue;
+      }
     }
 
-    DebugLog("Found a newer superblock: index %u, version %u\n", i, u32(superblock->version));
-    highest_version = superblock->version;
-    m_superblock_index = i;
+    DebugLog("Found superblock: index %u, version %u\n", index, version);
+    m_superblock_index = index;
     m_superblock = std::make_unique<Superblock>(*superblock);
+    return m_superblock.get();
   }
 
+  return nullptr;
+}
+
+ResultCode FileSystemImpl::FlushSuperblock() {
+  WIIFS_PROFILE(FlushSuperblock);
+  if (m_read_only)
+    return ResultCode::ReadOnly;
   if (!m_superblock)
-    return nullptr;
+    return ResultCode::NotFound;
+
+  m_fst_parents.clear();
+  ++m_change_token;
 
-  const auto hash = GenerateHmacForSuperblock(*m_superblock, m_superblock_index);
-  const auto read_result = ReadCluster(SuperblockCluster(m_superblock_index) + 15);
-  if (!read_result || (hash != read_result->hmac1 && hash != read_result->hmac2)) {
-    DebugLog("Error: Failed to verify superblock\n");
-    return nullptr;
+  if (m_options.async_commit) {
+    m_commit_cv.notify_all();
+    return ResultCode::Success;
   }
 
-  return m_superblock.get();
+  const ResultCode result = WriteSuperblock(m_superblock.get());
+  if (result == ResultCode::Success) {
+    m_committed_fat = m_superblock->fat;
+    m_committed_token = m_change_token;
+  }
+  return result;
 }
 
-ResultCode FileSystemImpl::FlushSuperblock() {
-  if (!m_superblock)
-    return ResultCode::NotFound;
+ResultCode FileSystemImpl::WriteSuperblock(Superblock* superblock) {
+  WIIFS_PROFILE(WriteSuperblock);
+  // Storage may persist writes in any order, so the data clusters this superblock references
+  // must be durable before it is written at all; flushing them later would be too late.
+  const ResultCode flush_result = FlushDirtyClusters(0, SUPERBLOCK_START_CLUSTER);
+  if (flush_result != ResultCode::Success)
+    return flush_result;
 
-  m_superblock->version = m_superblock->version + 1;
+  superblock->version = superblock->version + 1;
 
-  const auto write_block = [this]() {
+  const auto write_block = [this, superblock]() {
     m_superblock_index = (m_superblock_index + 1) % NUMBER_OF_SUPERBLOCKS;
-    const auto hmac = GenerateHmacForSuperblock(*m_superblock, m_superblock_index);
+    const auto hmac = GenerateHmacForSuperblock(*superblock, m_superblock_index);
     const crypto::Hash null_hmac{};
 
     for (u32 cluster = 0, offset = 0; cluster < CLUSTERS_PER_SUPERBLOCK; ++cluster) {
       const ResultCode result = WriteCluster(SuperblockCluster(m_superblock_index) + cluster,
-                                             reinterpret_cast<u8*>(m_superblock.get()) + offset,
+                                             reinterpret_cast<u8*>(superblock) + offset,
                                              cluster == 15 ? hmac : null_hmac);
       if (result != ResultCode::Success)
         return result;
+      Count(m_perf.superblock_bytes_written, CLUSTER_DATA_SIZE);
 
       static_assert(CLUSTERS_PER_SUPERBLOCK * CLUSTER_DATA_SIZE == sizeof(Superblock));
       offset += CLUSTER_DATA_SIZE;
@@ -284,17 +570,18 @@ ResultCode FileSystemImpl::FlushSuperblock() {
 
     // According to WiiQt/nandbin, 15 other versions should be written after an overflow
     // so that the driver doesn't pick an older superblock.
-    if (m_superblock->version == 0) {
+    if (superblock->version == 0) {
       DebugLog("Superblock version overflowed -- writing 15 extra versions\n");
       for (int i = 0; i < 15; ++i) {
-        const ResultCode result = FlushSuperblock();
+        const ResultCode result = WriteSuperblock(superblock);
         if (result != ResultCode::Success)
           return result;
       }
     }
 
+    Count(m_perf.superblock_flushes);
     DebugLog("Flushed superblock (index %u, version %u)\n", m_superblock_index,
-             static_cast<u32>(m_superblock->version));
+             static_cast<u32>(superblock->version));
     return ResultCode::Success;
   };
 
@@ -309,6 +596,8 @@ ResultCode FileSystemImpl::FlushSuperblock() {
 
 Result<u16> FileSystemImpl::GetFstIndex(const Superblock& superblock,
                                         const std::string& path) const {
+  WIIFS_PROFILE(GetFstIndex);
+  Count(m_perf.path_lookups);
   if (path == "/" || path.empty())
     return 0;
 
@@ -340,6 +629,54 @@ Result<u16> FileSystemImpl::GetFstIndex(const Superblock& superblock, u16 parent
   return ResultCode::Invalid;
 }
 
+std::optional<u16> FileSystemImpl::GetParentIndex(const Superblock& superblock, u16 fst_index) {
+  if (fst_index >= superblock.fst.size() || (superblock.fst[fst_index].mode & 3) == 0)
+    return {};
+
+  // Build the parent table in a single pass over the tree. It is invalidated whenever
+  // the superblock is flushed, which every change to the FST is followed by.
+  if (m_fst_parents.empty()) {
+    m_fst_parents.assign(superblock.fst.size(), 0xffff);
+    m_fst_parents[0] = 0;
+    std::vector<u16> directories{0};
+    while (!directories.empty()) {
+      const u16 directory = directories.back();
+      directories.pop_back();
+      for (u16 child = superblock.fst[directory].sub; child < superblock.fst.size();
+           child = superblock.fst[child].sib) {
+        // Stop at entries that have already been visited so that loops cannot hang us.
+        if (m_fst_parents[child] != 0xffff)
+          break;
+        m_fst_parents[child] = directory;
+        if (superblock.fst[child].IsDirectory())
+          directories.push_back(child);
+      }
+    }
+  }
+
+  if (m_fst_parents[fst_index] == 0xffff)
+    return {};
+  return m_fst_parents[fst_index];
+}
+
+std::string FileSystemImpl::GetPath(const Superblock& superblock, u16 fst_index) {
+  if (fst_index == 0)
+    return "/";
+
+  std::vector<std::string_view> components;
+  for (std::optional<u16> index = fst_index; index && *index != 0;
+       index = GetParentIndex(superblock, *index)) {
+    components.emplace_back(superblock.fst[*index].GetNameView());
+  }
+
+  std::string path;
+  for (auto it = components.rbegin(); it != components.rend(); ++it) {
+    path += '/';
+    path += *it;
+  }
+  return path;
+}
+
 Result<u16> FileSystemImpl::GetUnusedFstIndex(const Superblock& superblock) const {
   auto it = std::find_if(superblock.fst.begin(), superblock.fst.end(),
                          [](const FstEntry& entry) { return (entry.mode & 3) == 0; });
@@ -0,0 +1,288 @@
+// wiifs
+// Copyright 2018 leoetlino
+// Licensed under GPLv2+
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "driver/fs.h"
+#include "driver/perf.h"
+
+namespace wiifs {
+
+namespace {
+
+constexpr const char* PERF_OPERATION_NAMES[] = {
+    "Format",
+    "Sync",
+    "WaitForCommit",
+    "OpenFs",
+    "OpenFile",
+    "OpenFileByIndex",
+    "Close",
+    "ReadFile",
+    "WriteFile",
+    "ReadFileAt",
+    "WriteFileAt",
+    "ReadFileV",
+    "WriteFileV",
+    "SeekFile",
+    "GetFileStatus",
+    "Preallocate",
+    "CreateFile",
+    "CreateDirectory",
+    "Delete",
+    "Rename",
+    "ReadDirectory",
+    "ReadDirectoryPlus",
+    "ReadDirectoryByIndex",
+    "Walk",
+    "GetMetadata",
+    "GetMetadataByIndex",
+    "SetMetadata",
+    "GetNandStats",
+    "GetDirectoryStats",
+    "Scrub",
+    "Check",
+    "GetFragmentationReport",
+    "Defragment",
+    "ReadCluster",
+    "WriteCluster",
+    "GenerateHmacForData",
+    "FlushSuperblock",
+    "WriteSuperblock",
+    "GetFstIndex",
+};
+static_assert(std::size(PERF_OPERATION_NAMES) == size_t(PerfOperation::NumOperations));
+
+/// Small, stable identifier for the calling thread (for trace events).
+u32 GetThreadId() {
+  static std::atomic<u32> s_next_id{1};
+  thread_local const u32 id = s_next_id++;
+  return id;
+}
+
+/// Get the upper bound of the bucket that contains the specified percentile.
+u64 GetPercentile(const AtomicHistogram& histogram, const std::vector<u64>& counts, u64 total,
+                  double percentile) {
+  const u64 rank = std::max<u64>(1, u64(percentile / 100.0 * total + 0.5));
+  u64 seen = 0;
+  for (u32 i = 0; i < counts.size(); ++i) {
+    seen += counts[i];
+    if (seen >= rank)
+      return std::min(AtomicHistogram::GetBucketUpperBound(i), histogram.GetMax());
+  }
+  return histogram.GetMax();
+}
+
+}  // namespace
+
+const char* GetPerfOperationName(PerfOperation operation) {
+  return PERF_OPERATION_NAMES[size_t(operation)];
+}
+
+PerfCounters PerfCounterSet::Get() const {
+  constexpr auto order = std::memory_order_relaxed;
+  PerfCounters counters;
+  counters.clusters_read = clusters_read.load(order);
+  counters.clusters_written = clusters_written.load(order);
+  counters.bytes_decrypted = bytes_decrypted.load(order);
+  counters.bytes_encrypted = bytes_encrypted.load(order);
+  counters.hmacs_computed = hmacs_computed.load(order);
+  counters.hmac_failures = hmac_failures.load(order);
+  counters.ecc_computations = ecc_computations.load(order);
+  counters.superblock_flushes = superblock_flushes.load(order);
+  counters.superblock_bytes_written = superblock_bytes_written.load(order);
+  counters.cache_hits = cache_hits.load(order);
+  counters.cache_misses = cache_misses.load(order);
+  counters.fat_scans = fat_scans.load(order);
+  counters.path_lookups = path_lookups.load(order);
+  return counters;
+}
+
+std::string FormatPerfCounters(const PerfCounters& counters) {
+  const std::pair<const char*, u64> fields[] = {
+      {"clusters_read", counters.clusters_read},
+      {"clusters_written", counters.clusters_written},
+      {"bytes_decrypted", counters.bytes_decrypted},
+      {"bytes_encrypted", counters.bytes_encrypted},
+      {"hmacs_computed", counters.hmacs_computed},
+      {"hmac_failures", counters.hmac_failures},
+      {"ecc_computations", counters.ecc_computations},
+      {"superblock_flushes", counters.superblock_flushes},
+      {"superblock_bytes_written", counters.superblock_bytes_written},
+      {"cache_hits", counters.cache_hits},
+      {"cache_misses", counters.cache_misses},
+      {"fat_scans", counters.fat_scans},
+      {"path_lookups", counters.path_lookups},
+  };
+
+  std::string text;
+  for (const auto& [name, value] : fields) {
+    text += name;
+    text += ": ";
+    text += std::to_string(value);
+    text += '\n';
+  }
+  return text;
+}
+
+std::string FormatLatencyHistograms(const std::vector<LatencyHistogram>& histograms) {
+  std::string text;
+  char line[160];
+  std::snprintf(line, sizeof(line), "%-24s %10s %10s %10s %10s %10s %10s\n", "operation", "count",
+                "mean_us", "p50_us", "p99_us", "p99.9_us", "max_us");
+  text += line;
+  for (const LatencyHistogram& histogram : histograms) {
+    const double mean = histogram.count ? double(histogram.total_ns) / histogram.count : 0.0;
+    std::snprintf(line, sizeof(line), "%-24s %10" PRIu64 " %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+                  histogram.name.c_str(), histogram.count, mean / 1000, histogram.p50_ns / 1000.0,
+                  histogram.p99_ns / 1000.0, histogram.p999_ns / 1000.0,
+                  histogram.max_ns / 1000.0);
+    text += line;
+  }
+  return text;
+}
+
+std::vector<LatencyHistogram> Profiler::GetHistograms() const {
+  std::vector<LatencyHistogram> histograms;
+  std::vector<u64> counts(AtomicHistogram::NUM_BUCKETS);
+  for (size_t operation = 0; operation < m_histograms.size(); ++operation) {
+    const AtomicHistogram& histogram = m_histograms[operation];
+    // Use the sum of the buckets as the count so that the percentiles are consistent
+    // even if samples are recorded concurrently.
+    u64 count = 0;
+    for (u32 i = 0; i < counts.size(); ++i) {
+      counts[i] = histogram.GetBucketCount(i);
+      count += counts[i];
+    }
+    if (count == 0)
+      continue;
+
+    LatencyHistogram& result = histograms.emplace_back();
+    result.name = GetPerfOperationName(PerfOperation(operation));
+    result.count = count;
+    result.total_ns = histogram.GetTotal();
+    result.max_ns = histogram.GetMax();
+    result.p50_ns = GetPercentile(histogram, counts, count, 50);
+    result.p90_ns = GetPercentile(histogram, counts, count, 90);
+    result.p99_ns = GetPercentile(histogram, counts, count, 99);
+    result.p999_ns = GetPercentile(histogram, counts, count, 99.9);
+    for (u32 i = 0; i < counts.size(); ++i) {
+      if (counts[i] != 0) {
+        result.buckets.push_back({AtomicHistogram::GetBucketLowerBound(i),
+                                  AtomicHistogram::GetBucketUpperBound(i), counts[i]});
+      }
+    }
+  }
+  return histograms;
+}
+
+ResultCode Profiler::StartTracing(size_t max_events) {
+  std::lock_guard<std::mutex> lock{m_trace_mutex};
+  if (m_tracing || max_events == 0)
+    return ResultCode::Invalid;
+
+  m_trace_events.clear();
+  m_trace_events.resize(max_events);
+  m_next_trace_event = 0;
+  m_trace_wrapped = false;
+  m_tracing = true;
+  return ResultCode::Success;
+}
+
+void Profiler::RecordTraceEvent(PerfOperation operation, Clock::time_point start,
+                                Clock::time_point end) {
+  const u32 thread_id = GetThreadId();
+  std::lock_guard<std::mutex> lock{m_trace_mutex};
+  if (!m_tracing)
+    return;
+  m_trace_events[m_next_trace_event] = {operation, thread_id, start, end};
+  if (++m_next_trace_event == m_trace_events.size()) {
+    m_next_trace_event = 0;
+    m_trace_wrapped = true;
+  }
+}
+
+ResultCode Profiler::StopTracing(const std::string& path) {
+  std::vector<TraceEvent> events;
+  {
+    std::lock_guard<std::mutex> lock{m_trace_mutex};
+    if (!m_tracing)
+      return ResultCode::Invalid;
+    m_tracing = false;
+
+    // Put the events back in the order they were recorded in.
+    events = std::move(m_trace_events);
+    if (m_trace_wrapped)
+      std::rotate(events.begin(), events.begin() + m_next_trace_event, events.end());
+    else
+      events.resize(m_next_trace_event);
+    m_trace_events.clear();
+  }
+
+  std::unique_ptr<std::FILE, decltype(&std::fclose)> file{std::fopen(path.c_str(), "w"),
+                                                          &std::fclose};
+  if (!file)
+    return ResultCode::IoError;
+
+  // Timestamps are relative to the first event that was started.
+  Clock::time_point origin = events.empty() ? Clock::time_point{} : events.front().start;
+  for (const TraceEvent& event : events)
+    origin = std::min(origin, event.start);
+
+  const auto to_us = [](Clock::duration duration) {
+    return std::chrono::duration<double, std::micro>(duration).count();
+  };
+  bool ok = std::fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n", file.get()) >= 0;
+  for (size_t i = 0; i < events.size() && ok; ++i) {
+    const TraceEvent& event = events[i];
+    ok = std::fprintf(file.get(),
+                      "{\"name\":\"%s\",\"cat\":\"wiifs\",\"ph\":\"X\",\"ts\":%.3f,"
+                      "\"dur\":%.3f,\"pid\":1,\"tid\":%u}%s\n",
+                      GetPerfOperationName(event.operation), to_us(event.start - origin),
+                      to_us(event.end - event.start), event.thread_id,
+                      i + 1 == events.size() ? "" : ",") >= 0;
+  }
+  ok = ok && std::fputs("]}\n", file.get()) >= 0;
+  ok = std::fclose(file.release()) == 0 && ok;
+  return ok ? ResultCode::Success : ResultCode::IoError;
+}
+
+PerfCounters FileSystemImpl::GetPerfCounters() {
+  return m_perf.Get();
+}
+
+std::vector<LatencyHistogram> FileSystemImpl::GetLatencyHistograms() {
+#ifdef WIIFS_PROFILING
+  return m_profiler.GetHistograms();
+#else
+  return {};
+#endif
+}
+
+ResultCode FileSystemImpl::StartTracing(size_t max_events) {
+#ifdef WIIFS_PROFILING
+  return m_profiler.StartTracing(max_events);
+#else
+  return ResultCode::Invalid;
+#endif
+}
+
+ResultCode FileSystemImpl::StopTracing(const std::string& path) {
+#ifdef WIIFS_PROFILING
+  return m_profiler.StopTracing(path);
+#else
+  return ResultCode::Invalid;
+#endif
+}
+
+}  // namespace wiifs
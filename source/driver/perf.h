@@ -0,0 +1,158 @@
+// wiifs
+// Copyright 2018 leoetlino
+// Licensed under GPLv2+
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "common/common_types.h"
+#include "common/histogram.h"
+#include "wiifs/fs.h"
+#include "wiifs/result.h"
+
+namespace wiifs {
+
+/// Atomic counterparts of the fields of PerfCounters. They are updated with relaxed atomic
+/// increments, so they can be bumped from worker threads and read without taking any lock.
+struct PerfCounterSet {
+  std::atomic<u64> clusters_read{0};
+  std::atomic<u64> clusters_written{0};
+  std::atomic<u64> bytes_decrypted{0};
+  std::atomic<u64> bytes_encrypted{0};
+  std::atomic<u64> hmacs_computed{0};
+  std::atomic<u64> hmac_failures{0};
+  std::atomic<u64> ecc_computations{0};
+  std::atomic<u64> superblock_flushes{0};
+  std::atomic<u64> superblock_bytes_written{0};
+  std::atomic<u64> cache_hits{0};
+  std::atomic<u64> cache_misses{0};
+  std::atomic<u64> fat_scans{0};
+  std::atomic<u64> path_lookups{0};
+
+  PerfCounters Get() const;
+};
+
+inline void Count(std::atomic<u64>& counter, u64 amount = 1) {
+  counter.fetch_add(amount, std::memory_order_relaxed);
+}
+
+/// Operations whose latency is tracked: the public member functions of FileSystem
+/// and a few internal phases.
+enum class PerfOperation {
+  Format,
+  Sync,
+  WaitForCommit,
+  OpenFs,
+  OpenFile,
+  OpenFileByIndex,
+  Close,
+  ReadFile,
+  WriteFile,
+  ReadFileAt,
+  WriteFileAt,
+  ReadFileV,
+  WriteFileV,
+  SeekFile,
+  GetFileStatus,
+  Preallocate,
+  CreateFile,
+  CreateDirectory,
+  Delete,
+  Rename,
+  ReadDirectory,
+  ReadDirectoryPlus,
+  ReadDirectoryByIndex,
+  Walk,
+  GetMetadata,
+  GetMetadataByIndex,
+  SetMetadata,
+  GetNandStats,
+  GetDirectoryStats,
+  Scrub,
+  Check,
+  GetFragmentationReport,
+  Defragment,
+  // Internal phases
+  ReadCluster,
+  WriteCluster,
+  GenerateHmacForData,
+  FlushSuperblock,
+  WriteSuperblock,
+  GetFstIndex,
+
+  NumOperations,
+};
+
+const char* GetPerfOperationName(PerfOperation operation);
+
+/// Latency histograms for every PerfOperation, and an optional ring buffer of trace events.
+class Profiler final {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  void Record(PerfOperation operation, Clock::time_point start, Clock::time_point end) {
+    const auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start);
+    m_histograms[size_t(operation)].Record(u64(duration.count()));
+    if (m_tracing.load(std::memory_order_relaxed))
+      RecordTraceEvent(operation, start, end);
+  }
+
+  std::vector<LatencyHistogram> GetHistograms() const;
+  ResultCode StartTracing(size_t max_events);
+  ResultCode StopTracing(const std::string& path);
+
+private:
+  struct TraceEvent {
+    PerfOperation operation;
+    u32 thread_id;
+    Clock::time_point start;
+    Clock::time_point end;
+  };
+
+  void RecordTraceEvent(PerfOperation operation, Clock::time_point start, Clock::time_point end);
+
+  std::array<AtomicHistogram, size_t(PerfOperation::NumOperations)> m_histograms;
+
+  std::atomic<bool> m_tracing{false};
+  /// Only taken while tracing.
+  std::mutex m_trace_mutex;
+  std::vector<TraceEvent> m_trace_events;
+  /// Index of the slot for the next event. Once the buffer is full, it wraps around and
+  /// overwrites the oldest events.
+  size_t m_next_trace_event = 0;
+  bool m_trace_wrapped = false;
+};
+
+/// Records the time between its construction and its destruction.
+class ScopedProfile final {
+public:
+  ScopedProfile(Profiler& profiler, PerfOperation operation)
+      : m_profiler{profiler}, m_operation{operation}, m_start{Profiler::Clock::now()} {}
+  ~ScopedProfile() { m_profiler.Record(m_operation, m_start, Profiler::Clock::now()); }
+
+  ScopedProfile(const ScopedProfile&) = delete;
+  ScopedProfile& operator=(const ScopedProfile&) = delete;
+
+private:
+  Profiler& m_profiler;
+  PerfOperation m_operation;
+  Profiler::Clock::time_point m_start;
+};
+
+/// Profile the rest of the enclosing scope as the specified PerfOperation.
+/// Compiles to nothing if WIIFS_PROFILING is not defined.
+#ifdef WIIFS_PROFILING
+#define WIIFS_PROFILE(operation)                                                                   \
+  ::wiifs::ScopedProfile wiifs_profile_scope{m_profiler, ::wiifs::PerfOperation::operation}
+#else
+#define WIIFS_PROFILE(operation) static_cast<void>(0)
+#endif
+
+}  // namespace wiifs
@@ -0,0 +1,223 @@
+// wiifs
+// Copyright 2018 leoetlino
+// Licensed under GPLv2+
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include "common/align.h"
+#include "common/ecc.h"
+#include "common/logging.h"
+#include "driver/fs.h"
+
+namespace wiifs {
+
+namespace {
+
+constexpr u16 SUPERBLOCK_FST_INDEX = 0xffff;
+
+struct ScrubItem {
+  u16 cluster;
+  u16 fst_index;
+  u16 chain_index;
+};
+
+struct ScrubItemResult {
+  ResultCode error = ResultCode::Success;
+  bool read = false;
+  u32 corrected_bits = 0;
+  bool erased = false;
+  bool hmac_copy_mismatch = false;
+  crypto::Hash hmac1{};
+  crypto::Hash hmac2{};
+};
+
+bool IsErased(const u8* data, size_t size) {
+  return std::all_of(data, data + size, [](u8 byte) { return byte == 0xff; });
+}
+
+}  // namespace
+
+Result<ScrubReport> FileSystemImpl::Scrub(Fd fd, const ScrubProgressCallback& progress) {
+  WIIFS_PROFILE(Scrub);
+  std::lock_guard<std::mutex> lock{m_mutex};
+  const Handle* handle = GetHandleFromFd(fd);
+  if (!handle)
+    return ResultCode::Invalid;
+  if (handle->uid != 0)
+    return ResultCode::AccessDenied;
+
+  const auto* superblock = GetSuperblock();
+  if (!superblock)
+    return ResultCode::SuperblockInitFailed;
+
+  // Unflushed file data would otherwise not be checked.
+  const ResultCode flush_result = FlushFileCache();
+  if (flush_result != ResultCode::Success)
+    return flush_result;
+
+  const auto start_time = std::chrono::steady_clock::now();
+  ScrubReport report;
+
+  // Collect the clusters of every file that is reachable from the root directory.
+  std::vector<ScrubItem> items;
+  for (u16 index = 1; index < superblock->fst.size(); ++index) {
+    const FstEntry& entry = superblock->fst[index];
+    if (!entry.IsFile() || !GetParentIndex(*superblock, index))
+      continue;
+
+    const u32 num_clusters = AlignUp<u32>(entry.size, CLUSTER_DATA_SIZE) / CLUSTER_DATA_SIZE;
+    u16 cluster = entry.sub;
+    for (u32 chain_index = 0; chain_index < num_clusters; ++chain_index) {
+      if (cluster >= SUPERBLOCK_START_CLUSTER) {
+        report.errors.push_back({cluster, index, u16(chain_index), GetPath(*superblock, index),
+                                 ResultCode::Invalid});
+        break;
+      }
+      items.push_back({cluster, index, u16(chain_index)});
+      cluster = superblock->fat[cluster];
+    }
+  }
+  for (u32 slot = 0; slot < NUMBER_OF_SUPERBLOCKS; ++slot) {
+    for (u16 i = 0; i < CLUSTERS_PER_SUPERBLOCK; ++i)
+      items.push_back({u16(SuperblockCluster(slot) + i), SUPERBLOCK_FST_INDEX, i});
+  }
+
+  // Reading in physical order keeps the accesses sequential.
+  std::sort(items.begin(), items.end(),
+            [](const ScrubItem& a, const ScrubItem& b) { return a.cluster < b.cluster; });
+
+  // Superblocks can only be checked once all of their clusters have been read.
+  auto superblocks = std::make_unique<std::array<Superblock, NUMBER_OF_SUPERBLOCKS>>();
+
+  std::vector<ScrubItemResult> results(items.size());
+  const auto scrub_item = [&](size_t i) {
+    const ScrubItem& item = items[i];
+    ScrubItemResult& result = results[i];
+
+    std::array<u8, CLUSTER_RAW_SIZE> raw;
+    result.error = m_storage->ReadPages(PageIndex(item.cluster), PAGES_PER_CLUSTER, raw.data());
+    if (result.error != ResultCode::Success)
+      return;
+    result.read = true;
+    Count(m_perf.clusters_read);
+
+    const bool is_superblock = item.fst_index == SUPERBLOCK_FST_INDEX;
+    if (is_superblock && IsErased(raw.data(), raw.size())) {
+      result.erased = true;
+      return;
+    }
+
+    for (u32 page = 0; page < PAGES_PER_CLUSTER; ++page) {
+      u8* page_data = &raw[page * PAGE_SIZE];
+      ecc::EccData stored_ecc;
+      std::copy_n(page_data + DATA_BYTES_PER_PAGE + 0x30, stored_ecc.size(), stored_ecc.begin());
+      const ecc::CorrectionResult ecc_result = ecc::Correct(page_data, stored_ecc);
+      Count(m_perf.ecc_computations);
+      result.corrected_bits += ecc_result.corrected_bits + ecc_result.ecc_bit_errors;
+      if (ecc_result.uncorrectable)
+        result.error = ResultCode::CriticalEccError;
+    }
+    if (result.error != ResultCode::Success)
+      return;
+
+    if (is_superblock) {
+      const u32 slot = (item.cluster - SUPERBLOCK_START_CLUSTER) / CLUSTERS_PER_SUPERBLOCK;
+      u8* dest =
+          reinterpret_cast<u8*>(&(*superblocks)[slot]) + item.chain_index * CLUSTER_DATA_SIZE;
+      DecodeCluster(item.cluster, raw.data(), dest, &result.hmac1, &result.hmac2);
+      return;
+    }
+
+    std::array<u8, CLUSTER_DATA_SIZE> data;
+    DecodeCluster(item.cluster, raw.data(), data.data(), &result.hmac1, &result.hmac2);
+    const auto hash = GenerateHmacForData(*superblock, data.data(), item.fst_index,
+                                          item.chain_index);
+    if (hash != result.hmac1 && hash != result.hmac2) {
+      Count(m_perf.hmac_failures);
+      result.error = ResultCode::CheckFailed;
+    } else {
+      result.hmac_copy_mismatch = hash != result.hmac1 || hash != result.hmac2;
+    }
+  };
+
+  // Work is handed out in batches so that progress can be reported from this thread.
+  constexpr size_t BATCH_SIZE = 512;
+  for (size_t first = 0; first < items.size(); first += BATCH_SIZE) {
+    const size_t count = std::min(BATCH_SIZE, items.size() - first);
+    GetThreadPool().ParallelFor(count, [&](size_t i) { scrub_item(first + i); });
+    if (progress)
+      progress(u32(first + count), u32(items.size()));
+  }
+
+  std::array<u32, NUMBER_OF_SUPERBLOCKS> erased_clusters{};
+  std::array<bool, NUMBER_OF_SUPERBLOCKS> superblock_failed{};
+  std::array<const ScrubItemResult*, NUMBER_OF_SUPERBLOCKS> hmac_clusters{};
+  for (size_t i = 0; i < items.size(); ++i) {
+    const ScrubItem& item = items[i];
+    const ScrubItemResult& result = results[i];
+    if (result.read)
+      report.bytes_read += CLUSTER_RAW_SIZE;
+    report.ecc_corrected_bits += result.corrected_bits;
+
+    if (item.fst_index == SUPERBLOCK_FST_INDEX) {
+      const u32 slot = (item.cluster - SUPERBLOCK_START_CLUSTER) / CLUSTERS_PER_SUPERBLOCK;
+      erased_clusters[slot] += result.erased;
+      superblock_failed[slot] |= result.error != ResultCode::Success;
+      if (item.chain_index == CLUSTERS_PER_SUPERBLOCK - 1)
+        hmac_clusters[slot] = &result;
+    } else if (result.hmac_copy_mismatch) {
+      ++report.hmac_copy_mismatches;
+    }
+
+    ++report.checked_clusters;
+    if (result.error == ResultCode::Success)
+      continue;
+    if (item.fst_index == SUPERBLOCK_FST_INDEX) {
+      const u32 slot = (item.cluster - SUPERBLOCK_START_CLUSTER) / CLUSTERS_PER_SUPERBLOCK;
+      report.errors.push_back(
+          {item.cluster, item.fst_index, item.chain_index, {}, result.error, slot});
+    } else {
+      report.errors.push_back({item.cluster, item.fst_index, item.chain_index,
+                               GetPath(*superblock, item.fst_index), result.error});
+    }
+  }
+
+  for (u32 slot = 0; slot < NUMBER_OF_SUPERBLOCKS; ++slot) {
+    if (erased_clusters[slot] == CLUSTERS_PER_SUPERBLOCK) {
+      ++report.empty_superblocks;
+      continue;
+    }
+    if (superblock_failed[slot])
+      continue;
+
+    // A partially erased or otherwise invalid slot fails the HMAC check as well.
+    const crypto::Hash hash = GenerateHmacForSuperblock((*superblocks)[slot], slot);
+    const ScrubItemResult& result = *hmac_clusters[slot];
+    if ((*superblocks)[slot].magic != SUPERBLOCK_MAGIC ||
+        (hash != result.hmac1 && hash != result.hmac2)) {
+      Count(m_perf.hmac_failures);
+      report.errors.push_back({u16(SuperblockCluster(slot) + CLUSTERS_PER_SUPERBLOCK - 1),
+                               SUPERBLOCK_FST_INDEX, CLUSTERS_PER_SUPERBLOCK - 1, {},
+                               ResultCode::CheckFailed, slot});
+      continue;
+    }
+    if (hash != result.hmac1 || hash != result.hmac2)
+      ++report.hmac_copy_mismatches;
+    ++report.valid_superblocks;
+  }
+
+  std::sort(report.errors.begin(), report.errors.end(),
+            [](const ScrubError& a, const ScrubError& b) { return a.cluster < b.cluster; });
+  report.elapsed_seconds =
+      std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+  DebugLog("Scrub: checked %u clusters, %zu errors\n", report.checked_clusters,
+           report.errors.size());
+  return report;
+}
+
+}  // namespace wiifs
@@ -10,6 +10,10 @@
 namespace wiifs {
 
 std::string FstEntry::GetName() const {
+  return std::string(GetNameView());
+}
+
+std::string_view FstEntry::GetNameView() const {
   return {name.data(), strnlen(name.data(), name.size())};
 }
 
@@ -6,6 +6,7 @@
 
 #include <array>
 #include <string>
+#include <string_view>
 
 #include "common/common_types.h"
 #include "common/swap.h"
@@ -21,6 +22,14 @@ constexpr u32 DATA_BYTES_PER_PAGE = 2048;
 constexpr u32 SPARE_BYTES_PER_PAGE = 64;
 constexpr u32 PAGE_SIZE = DATA_BYTES_PER_PAGE + SPARE_BYTES_PER_PAGE;
 constexpr u32 CLUSTER_DATA_SIZE = PAGES_PER_CLUSTER * DATA_BYTES_PER_PAGE;
+/// Size of a cluster including spare data.
+constexpr u32 CLUSTER_RAW_SIZE = PAGES_PER_CLUSTER * PAGE_SIZE;
+static_assert(PAGE_SIZE == NAND_PAGE_SIZE, "Wrong page size");
+
+/// Get the index of a {cluster + page} relative to the start of the NAND.
+constexpr u32 PageIndex(u32 cluster_index, u32 page_index = 0) {
+  return cluster_index * PAGES_PER_CLUSTER + page_index;
+}
 
 /// Get an offset to a {cluster + page} relative to the start of the NAND.
 constexpr u32 Offset(u32 cluster_index, u32 page_index = 0) {
@@ -50,6 +59,7 @@ constexpr u32 HMAC2_SIZE_IN_PAGE2 = 20 - HMAC2_SIZE_IN_PAGE1;
 #pragma pack(push, 1)
 struct FstEntry {
   std::string GetName() const;
+  std::string_view GetNameView() const;
   void SetName(const std::string& new_name);
   bool IsFile() const;
   bool IsDirectory() const;
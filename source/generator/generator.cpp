@@ -0,0 +1,417 @@
+// wiifs
+// Copyright 2018 leoetlino
+// Licensed under GPLv2+
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "common/common_types.h"
+#include "wiifs/generator.h"
+
+namespace wiifs {
+
+namespace {
+
+constexpr FileMode RW = FileMode::Read | FileMode::Write;
+/// Number of fragmented files that are written interleaved with each other
+constexpr size_t INTERLEAVE_GROUP_SIZE = 4;
+constexpr u32 TITLE_TYPE_DISC = 0x00010000;
+constexpr u32 TITLE_TYPE_CHANNEL = 0x00010001;
+/// First uid that is assigned to titles in /sys/uid.sys
+constexpr Uid FIRST_TITLE_UID = 0x1000;
+/// The big endian title ID, two bytes of padding and the big endian uid
+constexpr u32 UID_SYS_ENTRY_SIZE = 12;
+
+/// SplitMix64. Unlike the standard library engines and distributions, this produces the same
+/// sequence on every platform, so images only depend on the seed.
+class Random {
+public:
+  explicit Random(u64 seed) : m_state{seed} {}
+
+  u64 Next() {
+    u64 z = (m_state += 0x9e3779b97f4a7c15);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+    return z ^ (z >> 31);
+  }
+
+  /// Uniform in [0, 1)
+  double Real() { return (Next() >> 11) * 0x1.0p-53; }
+
+  /// Uniform in [min, max]
+  u32 Uniform(u32 min, u32 max) {
+    if (max <= min)
+      return min;
+    return min + u32(Next() % (u64(max) - min + 1));
+  }
+
+  bool Chance(double probability) { return Real() < probability; }
+
+  u32 LogUniform(const FileSizeRange& range) {
+    const double min = std::max<u32>(range.min, 1);
+    const double max = std::max<double>(range.max, min);
+    const double size = std::exp(std::log(min) + (std::log(max) - std::log(min)) * Real());
+    return std::clamp<u32>(u32(size), range.min, std::max(range.min, range.max));
+  }
+
+  void Fill(u8* data, size_t size) {
+    for (size_t i = 0; i < size; i += sizeof(u64)) {
+      const u64 value = Next();
+      std::memcpy(data + i, &value, std::min(sizeof(u64), size - i));
+    }
+  }
+
+private:
+  u64 m_state;
+};
+
+std::string FormatHex(u32 value) {
+  char buffer[9];
+  std::snprintf(buffer, sizeof(buffer), "%08x", value);
+  return buffer;
+}
+
+struct PlannedFile {
+  std::string path;
+  u32 size;
+  /// Seed for the contents, so that they do not depend on the order in which files are written
+  u64 data_seed;
+};
+
+class Generator {
+public:
+  Generator(FileSystem& fs, const GeneratorOptions& options)
+      : m_fs{fs}, m_options{options}, m_random{options.seed} {}
+
+  Result<GeneratorReport> Run();
+
+private:
+  ResultCode Populate();
+
+  /// Treat a full FST or NAND as the end of generation rather than as an error.
+  ResultCode CheckFull(ResultCode result) {
+    if (result == ResultCode::FstFull || result == ResultCode::NoFreeSpace) {
+      m_full = true;
+      return ResultCode::Success;
+    }
+    return result;
+  }
+
+  /// Take the clusters for a file of the specified size from the fill budget.
+  /// Returns the size the file should actually have.
+  u32 TakeBudget(u32 size);
+
+  ResultCode CreateDirectory(const std::string& path, Uid uid, Gid gid, FileMode other_mode);
+  ResultCode AddFile(const std::string& path, u32 size, Uid uid, Gid gid);
+  ResultCode AddTitle();
+  ResultCode WriteFile(const PlannedFile& file);
+  ResultCode WriteInterleaved();
+  ResultCode WriteUidSys();
+
+  FileSystem& m_fs;
+  const GeneratorOptions& m_options;
+  Random m_random;
+  Fd m_fd = 0;
+  u32 m_cluster_size = 0;
+  u32 m_budget = 0;
+  bool m_full = false;
+  std::set<u64> m_title_ids;
+  std::vector<u64> m_titles;
+  /// Fragmented files that have been created but not written yet
+  std::vector<PlannedFile> m_pending;
+  std::vector<u8> m_buffer;
+  GeneratorReport m_report;
+};
+
+u32 Generator::TakeBudget(u32 size) {
+  const u32 clusters = u32((u64(size) + m_cluster_size - 1) / m_cluster_size);
+  if (clusters > m_budget) {
+    size = m_budget * m_cluster_size;
+    m_budget = 0;
+    return size;
+  }
+  m_budget -= clusters;
+  return size;
+}
+
+ResultCode Generator::CreateDirectory(const std::string& path, Uid uid, Gid gid,
+                                      FileMode other_mode) {
+  if (m_full)
+    return ResultCode::Success;
+  const auto result = m_fs.CreateDirectory(m_fd, path, 0, RW, RW, other_mode);
+  if (result == ResultCode::AlreadyExists)
+    return ResultCode::Success;
+  if (result != ResultCode::Success)
+    return CheckFull(result);
+  ++m_report.directories;
+  if (uid == 0 && gid == 0)
+    return ResultCode::Success;
+  return m_fs.SetMetadata(m_fd, path, uid, gid, 0, RW, FileMode::None, FileMode::None);
+}
+
+ResultCode Generator::AddFile(const std::string& path, u32 size, Uid uid, Gid gid) {
+  if (m_full)
+    return ResultCode::Success;
+  const FileMode other_mode = uid == 0 ? FileMode::Read : FileMode::None;
+  const auto result = m_fs.CreateFile(m_fd, path, 0, RW, RW, other_mode);
+  if (result != ResultCode::Success)
+    return CheckFull(result);
+  ++m_report.files;
+  if (uid != 0 || gid != 0) {
+    const auto metadata_result =
+        m_fs.SetMetadata(m_fd, path, uid, gid, 0, RW, FileMode::None, FileMode::None);
+    if (metadata_result != ResultCode::Success)
+      return metadata_result;
+  }
+
+  PlannedFile file{path, TakeBudget(size), m_random.Next()};
+  if (file.size == 0)
+    return ResultCode::Success;
+  // Files that span a single cluster cannot be fragmented.
+  if (file.size > m_cluster_size && m_random.Chance(m_options.fragmentation)) {
+    m_pending.push_back(std::move(file));
+    if (m_pending.size() < INTERLEAVE_GROUP_SIZE)
+      return ResultCode::Success;
+    return WriteInterleaved();
+  }
+  return WriteFile(file);
+}
+
+ResultCode Generator::WriteFile(const PlannedFile& file) {
+  m_buffer.resize(file.size);
+  Random{file.data_seed}.Fill(m_buffer.data(), m_buffer.size());
+
+  const auto fd = m_fs.OpenFile(0, 0, file.path, FileMode::Write);
+  if (!fd)
+    return fd.Error();
+  const auto result = m_fs.WriteFile(*fd, m_buffer.data(), file.size);
+  const auto close_result = m_fs.Close(*fd);
+  if (!result)
+    return CheckFull(result.Error());
+  m_report.bytes_written += *result;
+  return CheckFull(close_result);
+}
+
+ResultCode Generator::WriteInterleaved() {
+  std::vector<std::vector<u8>> data(m_pending.size());
+  std::vector<Fd> fds;
+  for (size_t i = 0; i < m_pending.size(); ++i) {
+    data[i].resize(m_pending[i].size);
+    Random{m_pending[i].data_seed}.Fill(data[i].data(), data[i].size());
+    const auto fd = m_fs.OpenFile(0, 0, m_pending[i].path, FileMode::Write);
+    if (!fd) {
+      for (const Fd opened : fds)
+        m_fs.Close(opened);
+      return fd.Error();
+    }
+    fds.push_back(*fd);
+  }
+
+  // Clusters are allocated in the order they are written, so writing one cluster of each
+  // file in turn makes every file's chain alternate with those of the others.
+  ResultCode result = ResultCode::Success;
+  for (u32 offset = 0; result == ResultCode::Success && !m_full; offset += m_cluster_size) {
+    bool wrote = false;
+    for (size_t i = 0; i < m_pending.size() && result == ResultCode::Success; ++i) {
+      if (offset >= m_pending[i].size)
+        continue;
+      const u32 length = std::min(m_cluster_size, m_pending[i].size - offset);
+      const auto write_result = m_fs.WriteFile(fds[i], &data[i][offset], length);
+      result = write_result ? ResultCode::Success : CheckFull(write_result.Error());
+      if (write_result)
+        m_report.bytes_written += *write_result;
+      wrote = true;
+    }
+    if (!wrote)
+      break;
+  }
+
+  for (const Fd fd : fds) {
+    const auto close_result = CheckFull(m_fs.Close(fd));
+    if (result == ResultCode::Success)
+      result = close_result;
+  }
+  m_pending.clear();
+  return result;
+}
+
+ResultCode Generator::AddTitle() {
+  const bool channel = m_random.Chance(m_options.channel_ratio);
+  u64 title_id;
+  do {
+    // Three random letters and a region code, like real game IDs.
+    static constexpr char REGIONS[] = "EPJK";
+    u32 game_id = 0;
+    for (int i = 0; i < 3; ++i)
+      game_id = (game_id << 8) | u32('A' + m_random.Uniform(0, 25));
+    game_id = (game_id << 8) | u32(REGIONS[m_random.Uniform(0, 3)]);
+    title_id = (u64(channel ? TITLE_TYPE_CHANNEL : TITLE_TYPE_DISC) << 32) | game_id;
+  } while (!m_title_ids.insert(title_id).second);
+
+  const Uid uid = FIRST_TITLE_UID + Uid(m_titles.size());
+  // Real titles use the maker code from the disc header as their gid.
+  const Gid gid = Gid(0x3030 + m_random.Uniform(0, 9) * 0x100 + m_random.Uniform(0, 9));
+  m_titles.push_back(title_id);
+  ++m_report.titles;
+
+  const std::string type = FormatHex(u32(title_id >> 32));
+  const std::string id = FormatHex(u32(title_id));
+  const std::string title_dir = "/title/" + type + "/" + id;
+
+  ResultCode result = CreateDirectory("/title/" + type, 0, 0, FileMode::Read);
+  if (result == ResultCode::Success)
+    result = CreateDirectory(title_dir, 0, 0, FileMode::Read);
+
+  if (channel && result == ResultCode::Success) {
+    const u32 num_contents = m_random.Uniform(m_options.min_contents, m_options.max_contents);
+    result = CreateDirectory("/ticket/" + type, 0, 0, FileMode::Read);
+    if (result == ResultCode::Success)
+      result = AddFile("/ticket/" + type + "/" + id + ".tik", 0x2a4, 0, 0);
+    if (result == ResultCode::Success)
+      result = CreateDirectory(title_dir + "/content", 0, 0, FileMode::Read);
+    if (result == ResultCode::Success)
+      result = AddFile(title_dir + "/content/title.tmd", 0x1e4 + 0x24 * num_contents, 0, 0);
+    for (u32 i = 0; i < num_contents && result == ResultCode::Success; ++i) {
+      result = AddFile(title_dir + "/content/" + FormatHex(i) + ".app",
+                       m_random.LogUniform(m_options.content_size), 0, 0);
+    }
+  }
+
+  if (result == ResultCode::Success)
+    result = CreateDirectory(title_dir + "/data", uid, gid, FileMode::None);
+  const u32 num_save_files = m_random.Uniform(m_options.min_save_files, m_options.max_save_files);
+  for (u32 i = 0; i < num_save_files && result == ResultCode::Success; ++i) {
+    char name[16];
+    std::snprintf(name, sizeof(name), i == 0 ? "banner.bin" : "save%02u.bin", i);
+    result = AddFile(title_dir + "/data/" + name, m_random.LogUniform(m_options.save_size), uid,
+                     gid);
+  }
+  return result;
+}
+
+ResultCode Generator::WriteUidSys() {
+  std::vector<u8> data(m_titles.size() * UID_SYS_ENTRY_SIZE);
+  for (size_t i = 0; i < m_titles.size(); ++i) {
+    u8* entry = &data[i * UID_SYS_ENTRY_SIZE];
+    for (int j = 0; j < 8; ++j)
+      entry[j] = u8(m_titles[i] >> (56 - 8 * j));
+    const Uid uid = FIRST_TITLE_UID + Uid(i);
+    entry[10] = u8(uid >> 8);
+    entry[11] = u8(uid);
+  }
+
+  const auto result = m_fs.CreateFile(m_fd, "/sys/uid.sys", 0, RW, RW, FileMode::None);
+  if (result != ResultCode::Success)
+    return CheckFull(result);
+  ++m_report.files;
+  if (data.empty())
+    return ResultCode::Success;
+  const auto fd = m_fs.OpenFile(0, 0, "/sys/uid.sys", FileMode::Write);
+  if (!fd)
+    return fd.Error();
+  const auto write_result = m_fs.WriteFile(*fd, data.data(), u32(data.size()));
+  const auto close_result = m_fs.Close(*fd);
+  if (!write_result)
+    return CheckFull(write_result.Error());
+  m_report.bytes_written += *write_result;
+  return CheckFull(close_result);
+}
+
+ResultCode Generator::Populate() {
+  // The directories that the system menu and IOS create on a freshly initialised NAND.
+  struct SystemDirectory {
+    const char* path;
+    FileMode other_mode;
+  };
+  static constexpr SystemDirectory SYSTEM_DIRECTORIES[] = {
+      {"/sys", FileMode::None},     {"/ticket", FileMode::Read}, {"/title", FileMode::Read},
+      {"/shared1", FileMode::None}, {"/shared2", RW},            {"/import", FileMode::None},
+      {"/meta", RW},                {"/tmp", RW},
+  };
+  for (const SystemDirectory& directory : SYSTEM_DIRECTORIES) {
+    const auto result = CreateDirectory(directory.path, 0, 0, directory.other_mode);
+    if (result != ResultCode::Success)
+      return result;
+  }
+
+  const auto stats = m_fs.GetNandStats(m_fd);
+  if (!stats)
+    return stats.Error();
+  m_cluster_size = stats->cluster_size;
+  m_budget = u32(stats->free_clusters * std::clamp(m_options.fill_level, 0.0, 1.0));
+  // Keep enough space for /sys/uid.sys, which is written last. (uids are only 16 bits wide.)
+  const u32 budget = m_budget;
+  TakeBudget(std::min<u32>(m_options.max_titles, 0x10000) * UID_SYS_ENTRY_SIZE);
+  const u32 uid_sys_clusters = budget - m_budget;
+
+  while (m_budget != 0 && !m_full && m_report.titles < m_options.max_titles) {
+    const auto result = AddTitle();
+    if (result != ResultCode::Success)
+      return result;
+  }
+  if (!m_pending.empty()) {
+    const auto result = WriteInterleaved();
+    if (result != ResultCode::Success)
+      return result;
+  }
+  m_budget += uid_sys_clusters;
+  const auto result = WriteUidSys();
+  if (result != ResultCode::Success)
+    return result;
+  return m_fs.Sync();
+}
+
+Result<GeneratorReport> Generator::Run() {
+  const auto start = std::chrono::steady_clock::now();
+
+  const auto format_result = m_fs.Format(0);
+  if (format_result != ResultCode::Success)
+    return format_result;
+  const auto fd = m_fs.OpenFs(0, 0);
+  if (!fd)
+    return fd.Error();
+  m_fd = *fd;
+
+  const auto result = Populate();
+  const auto stats = m_fs.GetNandStats(m_fd);
+  const auto fragmentation = m_fs.GetFragmentationReport(m_fd);
+  m_fs.Close(m_fd);
+  if (result != ResultCode::Success)
+    return result;
+  if (!stats)
+    return stats.Error();
+  if (!fragmentation)
+    return fragmentation.Error();
+
+  m_report.nand_stats = *stats;
+  m_report.fragmentation = *fragmentation;
+  m_report.elapsed_seconds =
+      std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  return m_report;
+}
+
+}  // namespace
+
+FileSystemOptions GetGeneratorFileSystemOptions() {
+  FileSystemOptions options;
+  // Nothing is committed until the generator syncs at the end. Generation never frees any
+  // cluster, so there is nothing that would have to wait for a commit before being reused,
+  // and the image does not depend on when commits happen to be made.
+  options.async_commit = true;
+  options.commit_interval_ms = std::numeric_limits<u32>::max();
+  options.commit_max_changes = std::numeric_limits<u32>::max();
+  return options;
+}
+
+Result<GeneratorReport> GenerateImage(FileSystem& fs, const GeneratorOptions& options) {
+  return Generator{fs, options}.Run();
+}
+
+}  // namespace wiifs
@@ -0,0 +1,325 @@
+// wiifs
+// Copyright 2018 leoetlino
+// Licensed under GPLv2+
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "common/align.h"
+#include "common/common_types.h"
+#include "common/logging.h"
+#include "storage/posix_io.h"
+#include "wiifs/fs.h"
+#include "wiifs/storage.h"
+
+namespace wiifs {
+
+namespace {
+
+/// O_DIRECT requires the file offset, the transfer size and the buffer address
+/// to be aligned to the logical sector size of the underlying device.
+constexpr size_t DIRECT_IO_ALIGNMENT = 512;
+
+/// Smallest allocation unit assumed for hole punching. Holes are only ever punched in
+/// whole units, so overestimating the file system block size is harmless.
+constexpr size_t MIN_HOLE_ALIGNMENT = 0x1000;
+
+#ifdef FALLOC_FL_PUNCH_HOLE
+constexpr bool CAN_PUNCH_HOLES = true;
+#else
+constexpr bool CAN_PUNCH_HOLES = false;
+#endif
+
+struct FreeDeleter {
+  void operator()(u8* ptr) const { std::free(ptr); }
+};
+using AlignedBuffer = std::unique_ptr<u8, FreeDeleter>;
+
+AlignedBuffer AllocateAlignedBuffer(size_t size) {
+  return AlignedBuffer{static_cast<u8*>(std::aligned_alloc(DIRECT_IO_ALIGNMENT, size))};
+}
+
+class FileStorage final : public Storage {
+public:
+  FileStorage(int fd, const FileStorageOptions& options, size_t block_size)
+      : m_fd{fd}, m_options{options}, m_hole_alignment{std::max(block_size, MIN_HOLE_ALIGNMENT)} {}
+  ~FileStorage() override { close(m_fd); }
+
+  ResultCode ReadPages(u32 first_page, u32 count, u8* data) override {
+    if (first_page >= NAND_PAGE_COUNT || count > NAND_PAGE_COUNT - first_page)
+      return ResultCode::Invalid;
+
+    const off_t offset = off_t(first_page) * NAND_PAGE_SIZE;
+    const size_t size = size_t(count) * NAND_PAGE_SIZE;
+    const ResultCode result = ReadBytes(data, size, offset);
+    if (result != ResultCode::Success) {
+      DebugLog("Error: Failed to read pages 0x%05x-0x%05x\n", first_page, first_page + count - 1);
+      return result;
+    }
+    if (m_options.sparse)
+      FillHoles(data, size, offset);
+    return ResultCode::Success;
+  }
+
+  ResultCode WritePages(u32 first_page, u32 count, const u8* data) override {
+    if (first_page >= NAND_PAGE_COUNT || count > NAND_PAGE_COUNT - first_page)
+      return ResultCode::Invalid;
+    if (m_options.read_only)
+      return ResultCode::ReadOnly;
+
+    const off_t offset = off_t(first_page) * NAND_PAGE_SIZE;
+    const size_t size = size_t(count) * NAND_PAGE_SIZE;
+    ResultCode result = ResultCode::Success;
+    if (m_options.sparse)
+      result = EraseAroundWrite(offset, offset + size);
+    if (result == ResultCode::Success)
+      result = WriteBytes(data, size, offset);
+    if (result != ResultCode::Success) {
+      DebugLog("Error: Failed to write pages 0x%05x-0x%05x\n", first_page,
+               first_page + count - 1);
+    }
+    return result;
+  }
+
+  ResultCode Flush(const std::vector<PageRange>& ranges) override {
+    if (m_options.read_only)
+      return ResultCode::Success;
+#ifdef __linux__
+    // Start writeback for every range first so that the I/O can be overlapped.
+    for (const PageRange& range : ranges) {
+      sync_file_range(m_fd, off_t(range.first_page) * NAND_PAGE_SIZE,
+                      off_t(range.count) * NAND_PAGE_SIZE, SYNC_FILE_RANGE_WRITE);
+    }
+#endif
+    // Unmodified pages are not written back, so this only costs as much as what changed.
+    if (!ranges.empty() && fdatasync(m_fd) != 0) {
+      DebugLog("Error: fdatasync failed: %s\n", std::strerror(errno));
+      return ResultCode::IoError;
+    }
+    return ResultCode::Success;
+  }
+
+  ResultCode Discard(const std::vector<PageRange>& ranges) override {
+    if (!CanDiscard())
+      return ResultCode::Success;
+
+    for (const PageRange& range : ranges) {
+      if (range.first_page >= NAND_PAGE_COUNT || range.count > NAND_PAGE_COUNT - range.first_page)
+        return ResultCode::Invalid;
+
+      const off_t start = off_t(range.first_page) * NAND_PAGE_SIZE;
+      const off_t end = start + off_t(range.count) * NAND_PAGE_SIZE;
+      const off_t hole_start = std::min<off_t>(AlignUp<u64>(start, m_hole_alignment), end);
+      const off_t hole_end = std::max<off_t>(AlignDown<u64>(end, m_hole_alignment), hole_start);
+
+      // Pages rarely line up with file system blocks. Blocks that are only partially covered
+      // cannot be deallocated, so the discarded part is explicitly erased instead.
+      if (hole_start != hole_end) {
+#ifdef FALLOC_FL_PUNCH_HOLE
+        if (fallocate(m_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, hole_start,
+                      hole_end - hole_start) != 0) {
+          DebugLog("Error: Failed to punch hole at 0x%llx: %s\n",
+                   static_cast<long long>(hole_start), std::strerror(errno));
+          return ResultCode::IoError;
+        }
+#endif
+      }
+      if (EraseUnlessHole(start, hole_start) != ResultCode::Success ||
+          EraseUnlessHole(hole_end, end) != ResultCode::Success) {
+        return ResultCode::IoError;
+      }
+    }
+    return ResultCode::Success;
+  }
+
+  bool CanDiscard() const override {
+    return CAN_PUNCH_HOLES && m_options.sparse && !m_options.read_only;
+  }
+
+private:
+  ResultCode ReadBytes(u8* data, size_t size, off_t offset) {
+    if (m_options.direct_io)
+      return ReadDirect(data, size, offset);
+    if (!ReadAll(m_fd, data, size, offset)) {
+      DebugLog("Error: Read at 0x%llx failed: %s\n", static_cast<long long>(offset),
+               std::strerror(errno));
+      return ResultCode::IoError;
+    }
+    return ResultCode::Success;
+  }
+
+  ResultCode WriteBytes(const u8* data, size_t size, off_t offset) {
+    if (m_options.direct_io)
+      return WriteDirect(data, size, offset);
+    if (!WriteAll(m_fd, data, size, offset)) {
+      DebugLog("Error: Write at 0x%llx failed: %s\n", static_cast<long long>(offset),
+               std::strerror(errno));
+      return ResultCode::IoError;
+    }
+    return ResultCode::Success;
+  }
+
+  /// Overwrite every part of `data` that was read from a hole with 0xff (erased NAND).
+  void FillHoles(u8* data, size_t size, off_t offset) const {
+    const off_t end = offset + size;
+    off_t position = offset;
+    while (position < end) {
+      // The file position is irrelevant (all I/O is positioned), so concurrent seeks are fine.
+      const off_t hole = lseek(m_fd, position, SEEK_HOLE);
+      if (hole < 0 || hole >= end)
+        return;
+      off_t next_data = lseek(m_fd, hole, SEEK_DATA);
+      if (next_data < 0 || next_data > end)
+        next_data = end;
+      std::memset(data + (hole - offset), 0xff, next_data - hole);
+      position = next_data;
+    }
+  }
+
+  /// Whether [start, end) is entirely a hole.
+  bool IsHole(off_t start, off_t end) const {
+    const off_t next_data = lseek(m_fd, start, SEEK_DATA);
+    return next_data < 0 || next_data >= end;
+  }
+
+  /// Erase [start, end) by writing 0xff, unless that range is already entirely a hole.
+  ResultCode EraseUnlessHole(off_t start, off_t end) {
+    if (start >= end || IsHole(start, end))
+      return ResultCode::Success;
+    const std::vector<u8> erased(end - start, 0xff);
+    return WriteBytes(erased.data(), erased.size(), start);
+  }
+
+  /// Writing into a hole allocates whole blocks, and the parts of them that are not written
+  /// then read back as zeroes rather than as a hole. Before writing [start, end), erase the
+  /// rest of the partially covered blocks at either end if they are still holes, so that
+  /// discarded pages which share a block with written ones keep reading back as erased.
+  ResultCode EraseAroundWrite(off_t start, off_t end) {
+    const off_t head = AlignDown<u64>(start, m_hole_alignment);
+    const off_t tail = std::min<off_t>(AlignUp<u64>(end, m_hole_alignment), NAND_SIZE);
+    const bool head_is_hole = head != start && IsHole(head, start);
+    const bool tail_is_hole = tail != end && IsHole(end, tail);
+    if (!head_is_hole && !tail_is_hole)
+      return ResultCode::Success;
+
+    // A neighbouring write may be filling the same block. Whichever one gets here first
+    // erases it; the other one then no longer sees a hole and must not erase it again.
+    std::lock_guard<std::mutex> lock{m_hole_mutex};
+    for (const auto& [erase_start, erase_end] : {std::pair{head, start}, std::pair{end, tail}}) {
+      if (erase_start == erase_end || !IsHole(erase_start, erase_end))
+        continue;
+      const std::vector<u8> erased(erase_end - erase_start, 0xff);
+      const ResultCode result = WriteBytes(erased.data(), erased.size(), erase_start);
+      if (result != ResultCode::Success)
+        return result;
+    }
+    return ResultCode::Success;
+  }
+
+  ResultCode ReadDirect(u8* data, size_t size, off_t offset) {
+    const off_t start = AlignDown<u64>(offset, DIRECT_IO_ALIGNMENT);
+    const off_t end = AlignUp<u64>(offset + size, DIRECT_IO_ALIGNMENT);
+    const AlignedBuffer buffer = AllocateAlignedBuffer(end - start);
+    if (!buffer || !ReadAll(m_fd, buffer.get(), end - start, start)) {
+      DebugLog("Error: Direct read at 0x%llx failed: %s\n", static_cast<long long>(offset),
+               std::strerror(errno));
+      return ResultCode::IoError;
+    }
+    std::memcpy(data, buffer.get() + (offset - start), size);
+    return ResultCode::Success;
+  }
+
+  ResultCode WriteDirect(const u8* data, size_t size, off_t offset) {
+    const off_t start = AlignDown<u64>(offset, DIRECT_IO_ALIGNMENT);
+    const off_t end = AlignUp<u64>(offset + size, DIRECT_IO_ALIGNMENT);
+    const AlignedBuffer buffer = AllocateAlignedBuffer(end - start);
+    if (!buffer)
+      return ResultCode::IoError;
+
+    // Whole clusters are always sector-aligned, but single pages are not. Partial sectors
+    // are shared with neighbouring pages, so the read-modify-write must not race with another.
+    std::unique_lock<std::mutex> lock{m_rmw_mutex, std::defer_lock};
+    if (start != offset || size_t(end - start) != size) {
+      lock.lock();
+      if (!ReadAll(m_fd, buffer.get(), DIRECT_IO_ALIGNMENT, start) ||
+          !ReadAll(m_fd, buffer.get() + (end - start) - DIRECT_IO_ALIGNMENT,
+                   DIRECT_IO_ALIGNMENT, end - DIRECT_IO_ALIGNMENT)) {
+        return ResultCode::IoError;
+      }
+    }
+
+    std::memcpy(buffer.get() + (offset - start), data, size);
+    if (!WriteAll(m_fd, buffer.get(), end - start, start)) {
+      DebugLog("Error: Direct write at 0x%llx failed: %s\n", static_cast<long long>(offset),
+               std::strerror(errno));
+      return ResultCode::IoError;
+    }
+    return ResultCode::Success;
+  }
+
+  int m_fd;
+  FileStorageOptions m_options;
+  size_t m_hole_alignment;
+  std::mutex m_rmw_mutex;
+  std::mutex m_hole_mutex;
+};
+
+}  // namespace
+
+Result<std::unique_ptr<Storage>> Storage::OpenFile(const std::string& path,
+                                                   const FileStorageOptions& options) {
+  int flags = (options.read_only ? O_RDONLY : O_RDWR) | O_CLOEXEC;
+  if (options.create && !options.read_only)
+    flags |= O_CREAT;
+  if (options.direct_io) {
+#ifdef O_DIRECT
+    flags |= O_DIRECT;
+#else
+    return ResultCode::Invalid;
+#endif
+  }
+
+  const int fd = open(path.c_str(), flags, 0644);
+  if (fd < 0) {
+    const int error = errno;
+    DebugLog("Error: Failed to open %s: %s\n", path.c_str(), std::strerror(error));
+    return error == ENOENT ? ResultCode::NotFound : ResultCode::IoError;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    DebugLog("Error: Failed to stat %s: %s\n", path.c_str(), std::strerror(errno));
+    close(fd);
+    return ResultCode::IoError;
+  }
+
+  // Extending the file does not allocate any space: the image starts out as one big hole.
+  if (options.create && !options.read_only && st.st_size == 0) {
+    if (ftruncate(fd, NAND_SIZE) != 0) {
+      DebugLog("Error: Failed to resize %s: %s\n", path.c_str(), std::strerror(errno));
+      close(fd);
+      return ResultCode::IoError;
+    }
+    st.st_size = NAND_SIZE;
+  }
+
+  if (u64(st.st_size) < NAND_SIZE) {
+    DebugLog("Error: %s is not a valid NAND image\n", path.c_str());
+    close(fd);
+    return ResultCode::Invalid;
+  }
+
+  return std::unique_ptr<Storage>(std::make_unique<FileStorage>(fd, options, st.st_blksize));
+}
+
+}  // namespace wiifs
@@ -0,0 +1,91 @@
+// wiifs
+// Copyright 2018 leoetlino
+// Licensed under GPLv2+
+
+#include <algorithm>
+#include <cerrno>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "common/align.h"
+#include "common/common_types.h"
+#include "wiifs/storage.h"
+
+namespace wiifs {
+
+namespace {
+
+class MemoryStorage final : public Storage {
+public:
+  explicit MemoryStorage(u8* nand) : m_nand{nand} {}
+
+  ResultCode ReadPages(u32 first_page, u32 count, u8* data) override {
+    if (first_page >= NAND_PAGE_COUNT || count > NAND_PAGE_COUNT - first_page)
+      return ResultCode::Invalid;
+    std::copy_n(m_nand + size_t(first_page) * NAND_PAGE_SIZE, size_t(count) * NAND_PAGE_SIZE,
+                data);
+    return ResultCode::Success;
+  }
+
+  ResultCode WritePages(u32 first_page, u32 count, const u8* data) override {
+    if (first_page >= NAND_PAGE_COUNT || count > NAND_PAGE_COUNT - first_page)
+      return ResultCode::Invalid;
+    std::copy_n(data, size_t(count) * NAND_PAGE_SIZE,
+                m_nand + size_t(first_page) * NAND_PAGE_SIZE);
+    return ResultCode::Success;
+  }
+
+  ResultCode Flush(const std::vector<PageRange>& ranges) override {
+    const uintptr_t host_page_size = sysconf(_SC_PAGESIZE);
+    for (const PageRange& range : ranges) {
+      const uintptr_t start =
+          reinterpret_cast<uintptr_t>(m_nand) + uintptr_t(range.first_page) * NAND_PAGE_SIZE;
+      const uintptr_t end = start + uintptr_t(range.count) * NAND_PAGE_SIZE;
+      const uintptr_t aligned_start = AlignDown(start, host_page_size);
+      // ENOMEM means that the memory is not a mapping (so there is nothing to write back).
+      if (msync(reinterpret_cast<void*>(aligned_start), end - aligned_start, MS_SYNC) != 0 &&
+          errno != ENOMEM) {
+        return ResultCode::IoError;
+      }
+    }
+    return ResultCode::Success;
+  }
+
+private:
+  u8* m_nand;
+};
+
+class ReadOnlyMemoryStorage final : public Storage {
+public:
+  explicit ReadOnlyMemoryStorage(const u8* nand) : m_nand{nand} {}
+
+  ResultCode ReadPages(u32 first_page, u32 count, u8* data) override {
+    if (first_page >= NAND_PAGE_COUNT || count > NAND_PAGE_COUNT - first_page)
+      return ResultCode::Invalid;
+    std::copy_n(m_nand + size_t(first_page) * NAND_PAGE_SIZE, size_t(count) * NAND_PAGE_SIZE,
+                data);
+    return ResultCode::Success;
+  }
+
+  ResultCode WritePages(u32 first_page, u32 count, const u8* data) override {
+    return ResultCode::ReadOnly;
+  }
+
+  ResultCode Flush(const std::vector<PageRange>& ranges) override { return ResultCode::Success; }
+
+private:
+  const u8* m_nand;
+};
+
+}  // namespace
+
+std::unique_ptr<Storage> Storage::CreateForMemory(u8* nand_bytes) {
+  return std::make_unique<MemoryStorage>(nand_bytes);
+}
+
+std::unique_ptr<Storage> Storage::CreateForReadOnlyMemory(const u8* nand_bytes) {
+  return std::make_unique<ReadOnlyMemoryStorage>(nand_bytes);
+}
+
+}  // namespace wiifs
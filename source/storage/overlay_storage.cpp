@@ -0,0 +1,316 @@
+// wiifs
+// Copyright 2018 leoetlino
+// Licensed under GPLv2+
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "common/common_types.h"
+#include "common/logging.h"
+#include "storage/posix_io.h"
+#include "wiifs/storage.h"
+
+namespace wiifs {
+
+namespace {
+
+// Delta file layout: a header followed by fixed-size records, each of which holds one page.
+// Records are appended the first time a page is written and updated in place afterwards,
+// so the page index can be rebuilt by scanning the record headers. Each record has a checksum
+// of its page so that a record which was only partially written can be detected.
+
+constexpr std::array<char, 4> DELTA_MAGIC{{'W', 'F', 'S', 'D'}};
+constexpr u32 DELTA_VERSION = 2;
+constexpr u32 RECORD_MAGIC = 0x50414745;  // "PAGE"
+
+struct DeltaHeader {
+  std::array<char, 4> magic;
+  u32 version;
+  u32 page_size;
+  u32 reserved;
+};
+static_assert(sizeof(DeltaHeader) == 16);
+
+struct RecordHeader {
+  u32 magic;
+  u32 page;
+  /// CRC-32 of the page index and the page data
+  u32 checksum;
+};
+static_assert(sizeof(RecordHeader) == 12);
+
+constexpr off_t RECORD_SIZE = sizeof(RecordHeader) + NAND_PAGE_SIZE;
+
+constexpr off_t RecordOffset(u32 record) {
+  return sizeof(DeltaHeader) + off_t(record) * RECORD_SIZE;
+}
+
+constexpr std::array<u32, 256> MakeCrc32Table() {
+  std::array<u32, 256> table{};
+  for (u32 i = 0; i < table.size(); ++i) {
+    u32 value = i;
+    for (int bit = 0; bit < 8; ++bit)
+      value = (value & 1) ? (value >> 1) ^ 0xedb88320 : value >> 1;
+    table[i] = value;
+  }
+  return table;
+}
+
+constexpr std::array<u32, 256> CRC32_TABLE = MakeCrc32Table();
+
+u32 Crc32(u32 crc, const u8* data, size_t size) {
+  crc = ~crc;
+  for (size_t i = 0; i < size; ++i)
+    crc = CRC32_TABLE[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+  return ~crc;
+}
+
+u32 GetRecordChecksum(u32 page, const u8* data) {
+  return Crc32(Crc32(0, reinterpret_cast<const u8*>(&page), sizeof(page)), data, NAND_PAGE_SIZE);
+}
+
+bool IsValidPageRange(u32 first_page, u32 count) {
+  return first_page < NAND_PAGE_COUNT && count <= NAND_PAGE_COUNT - first_page;
+}
+
+class DeltaFile final {
+public:
+  ~DeltaFile() {
+    if (m_fd >= 0)
+      close(m_fd);
+  }
+
+  ResultCode Open(const std::string& path, bool create) {
+    m_fd = open(path.c_str(), (create ? O_RDWR | O_CREAT : O_RDONLY) | O_CLOEXEC, 0644);
+    if (m_fd < 0) {
+      const int error = errno;
+      DebugLog("Error: Failed to open %s: %s\n", path.c_str(), std::strerror(error));
+      return error == ENOENT ? ResultCode::NotFound : ResultCode::IoError;
+    }
+
+    struct stat st;
+    if (fstat(m_fd, &st) != 0)
+      return ResultCode::IoError;
+
+    if (st.st_size == 0 && create) {
+      const DeltaHeader header{DELTA_MAGIC, DELTA_VERSION, NAND_PAGE_SIZE, 0};
+      if (!WriteAll(m_fd, reinterpret_cast<const u8*>(&header), sizeof(header), 0))
+        return ResultCode::IoError;
+      return ResultCode::Success;
+    }
+
+    DeltaHeader header;
+    if (!ReadAll(m_fd, reinterpret_cast<u8*>(&header), sizeof(header), 0) ||
+        header.magic != DELTA_MAGIC || header.version != DELTA_VERSION ||
+        header.page_size != NAND_PAGE_SIZE) {
+      DebugLog("Error: %s is not a valid delta file\n", path.c_str());
+      return ResultCode::Invalid;
+    }
+
+    // A record that was only partially written when the process died fails the checksum and
+    // is ignored, so the page is read from the base (or an earlier record) instead. Its write
+    // was never flushed, so nothing that was reported as durable is lost. Invalid records at
+    // the end of the file are dropped so that their space is reused by the next appends.
+    const u32 num_records = (st.st_size - sizeof(DeltaHeader)) / RECORD_SIZE;
+    std::vector<u8> record_data(RECORD_SIZE);
+    u32 num_good_records = 0;
+    for (u32 record = 0; record < num_records; ++record) {
+      if (!ReadAll(m_fd, record_data.data(), record_data.size(), RecordOffset(record)))
+        return ResultCode::IoError;
+      RecordHeader record_header;
+      std::memcpy(&record_header, record_data.data(), sizeof(record_header));
+      const u8* page_data = record_data.data() + sizeof(record_header);
+      if (record_header.magic != RECORD_MAGIC || record_header.page >= NAND_PAGE_COUNT ||
+          record_header.checksum != GetRecordChecksum(record_header.page, page_data)) {
+        DebugLog("Warning: Ignoring invalid record %u in %s\n", record, path.c_str());
+        continue;
+      }
+      m_records[record_header.page] = record;
+      num_good_records = record + 1;
+    }
+    m_num_records = num_good_records;
+
+    if (create && st.st_size != RecordOffset(num_good_records) &&
+        ftruncate(m_fd, RecordOffset(num_good_records)) != 0) {
+      return ResultCode::IoError;
+    }
+    return ResultCode::Success;
+  }
+
+  /// Returns the record that holds the specified page, if there is one.
+  std::optional<u32> Find(u32 page) const {
+    std::lock_guard<std::mutex> lock{m_mutex};
+    const auto it = m_records.find(page);
+    if (it == m_records.end())
+      return std::nullopt;
+    return it->second;
+  }
+
+  bool ReadPage(u32 record, u8* data) const {
+    return ReadAll(m_fd, data, NAND_PAGE_SIZE, RecordOffset(record) + sizeof(RecordHeader));
+  }
+
+  bool WritePage(u32 page, const u8* data) {
+    u32 record;
+    {
+      std::lock_guard<std::mutex> lock{m_mutex};
+      const auto [it, inserted] = m_records.emplace(page, m_num_records);
+      if (inserted)
+        ++m_num_records;
+      record = it->second;
+    }
+
+    RecordHeader header{RECORD_MAGIC, page, GetRecordChecksum(page, data)};
+    std::array<iovec, 2> iov{{{&header, sizeof(header)}, {const_cast<u8*>(data), NAND_PAGE_SIZE}}};
+    const off_t offset = RecordOffset(record);
+    while (true) {
+      const ssize_t result = pwritev(m_fd, iov.data(), iov.size(), offset);
+      if (result < 0 && errno == EINTR)
+        continue;
+      if (result == RECORD_SIZE)
+        return true;
+      // Fall back to plain writes to finish a short write.
+      return result >= 0 &&
+             WriteAll(m_fd, reinterpret_cast<const u8*>(&header), sizeof(header), offset) &&
+             WriteAll(m_fd, data, NAND_PAGE_SIZE, offset + sizeof(header));
+    }
+  }
+
+  bool Sync() { return fdatasync(m_fd) == 0; }
+
+  /// Returns every page that is stored in the delta with its record, sorted by page.
+  std::vector<std::pair<u32, u32>> GetPages() const {
+    std::lock_guard<std::mutex> lock{m_mutex};
+    std::vector<std::pair<u32, u32>> pages{m_records.begin(), m_records.end()};
+    std::sort(pages.begin(), pages.end());
+    return pages;
+  }
+
+private:
+  int m_fd = -1;
+  mutable std::mutex m_mutex;
+  std::unordered_map<u32, u32> m_records;
+  u32 m_num_records = 0;
+};
+
+class OverlayStorage final : public Storage {
+public:
+  OverlayStorage(std::unique_ptr<Storage> base, std::unique_ptr<DeltaFile> delta)
+      : m_base{std::move(base)}, m_delta{std::move(delta)} {}
+
+  ResultCode ReadPages(u32 first_page, u32 count, u8* data) override {
+    if (!IsValidPageRange(first_page, count))
+      return ResultCode::Invalid;
+
+    // Pages that are not in the delta are read from the base in as few calls as possible.
+    u32 base_run_start = first_page;
+    const auto read_base_run = [&](u32 end) {
+      if (base_run_start == end)
+        return ResultCode::Success;
+      return m_base->ReadPages(base_run_start, end - base_run_start,
+                               data + size_t(base_run_start - first_page) * NAND_PAGE_SIZE);
+    };
+
+    for (u32 page = first_page; page < first_page + count; ++page) {
+      const std::optional<u32> record = m_delta->Find(page);
+      if (!record)
+        continue;
+      const ResultCode result = read_base_run(page);
+      if (result != ResultCode::Success)
+        return result;
+      if (!m_delta->ReadPage(*record, data + size_t(page - first_page) * NAND_PAGE_SIZE)) {
+        DebugLog("Error: Failed to read page 0x%05x from delta: %s\n", page,
+                 std::strerror(errno));
+        return ResultCode::IoError;
+      }
+      base_run_start = page + 1;
+    }
+    return read_base_run(first_page + count);
+  }
+
+  ResultCode WritePages(u32 first_page, u32 count, const u8* data) override {
+    if (!IsValidPageRange(first_page, count))
+      return ResultCode::Invalid;
+
+    for (u32 i = 0; i < count; ++i) {
+      if (!m_delta->WritePage(first_page + i, data + size_t(i) * NAND_PAGE_SIZE)) {
+        DebugLog("Error: Failed to write page 0x%05x to delta: %s\n", first_page + i,
+                 std::strerror(errno));
+        return ResultCode::IoError;
+      }
+    }
+    return ResultCode::Success;
+  }
+
+  ResultCode Flush(const std::vector<PageRange>& ranges) override {
+    if (!ranges.empty() && !m_delta->Sync()) {
+      DebugLog("Error: Failed to sync delta: %s\n", std::strerror(errno));
+      return ResultCode::IoError;
+    }
+    return ResultCode::Success;
+  }
+
+private:
+  std::unique_ptr<Storage> m_base;
+  std::unique_ptr<DeltaFile> m_delta;
+};
+
+}  // namespace
+
+Result<std::unique_ptr<Storage>> Storage::CreateOverlay(std::unique_ptr<Storage> base,
+                                                        const std::string& delta_path) {
+  auto delta = std::make_unique<DeltaFile>();
+  const ResultCode result = delta->Open(delta_path, true);
+  if (result != ResultCode::Success)
+    return result;
+  return std::unique_ptr<Storage>(
+      std::make_unique<OverlayStorage>(std::move(base), std::move(delta)));
+}
+
+ResultCode Storage::MergeOverlay(const std::string& delta_path, Storage& target) {
+  DeltaFile delta;
+  const ResultCode open_result = delta.Open(delta_path, false);
+  if (open_result != ResultCode::Success)
+    return open_result;
+
+  // Consecutive pages are written to the target with a single call (up to a limit).
+  constexpr size_t MAX_PAGES_PER_WRITE = 0x100;
+  const std::vector<std::pair<u32, u32>> pages = delta.GetPages();
+  std::vector<PageRange> ranges;
+  std::vector<u8> buffer;
+  for (size_t i = 0; i < pages.size();) {
+    size_t end = i + 1;
+    while (end < pages.size() && end - i < MAX_PAGES_PER_WRITE &&
+           pages[end].first == pages[end - 1].first + 1) {
+      ++end;
+    }
+
+    buffer.resize((end - i) * NAND_PAGE_SIZE);
+    for (size_t j = i; j < end; ++j) {
+      if (!delta.ReadPage(pages[j].second, buffer.data() + (j - i) * NAND_PAGE_SIZE))
+        return ResultCode::IoError;
+    }
+    const ResultCode result = target.WritePages(pages[i].first, end - i, buffer.data());
+    if (result != ResultCode::Success)
+      return result;
+    ranges.push_back({pages[i].first, u32(end - i)});
+    i = end;
+  }
+  return target.Flush(ranges);
+}
+
+}  // namespace wiifs
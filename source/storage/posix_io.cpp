@@ -0,0 +1,41 @@
+// wiifs
+// Copyright 2018 leoetlino
+// Licensed under GPLv2+
+
+#include <cerrno>
+
+#include <unistd.h>
+
+#include "storage/posix_io.h"
+
+namespace wiifs {
+
+bool ReadAll(int fd, u8* data, size_t size, off_t offset) {
+  while (size != 0) {
+    const ssize_t result = pread(fd, data, size, offset);
+    if (result < 0 && errno == EINTR)
+      continue;
+    if (result <= 0)
+      return false;
+    data += result;
+    size -= result;
+    offset += result;
+  }
+  return true;
+}
+
+bool WriteAll(int fd, const u8* data, size_t size, off_t offset) {
+  while (size != 0) {
+    const ssize_t result = pwrite(fd, data, size, offset);
+    if (result < 0 && errno == EINTR)
+      continue;
+    if (result <= 0)
+      return false;
+    data += result;
+    size -= result;
+    offset += result;
+  }
+  return true;
+}
+
+}  // namespace wiifs
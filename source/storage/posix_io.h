@@ -0,0 +1,18 @@
+// wiifs
+// Copyright 2018 leoetlino
+// Licensed under GPLv2+
+
+#pragma once
+
+#include <sys/types.h>
+
+#include "common/common_types.h"
+
+namespace wiifs {
+
+/// Read exactly `size` bytes at `offset`, retrying after short reads and interruptions.
+bool ReadAll(int fd, u8* data, size_t size, off_t offset);
+/// Write exactly `size` bytes at `offset`, retrying after short writes and interruptions.
+bool WriteAll(int fd, const u8* data, size_t size, off_t offset);
+
+}  // namespace wiifs
@@ -0,0 +1,115 @@
+// wiifs
+// Copyright 2018 leoetlino
+// Licensed under GPLv2+
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <memory>
+
+#include "common/common_types.h"
+#include "wiifs/storage.h"
+
+namespace wiifs {
+
+namespace {
+
+/// Pages are allocated in groups of 8, which is the size of a cluster.
+constexpr u32 PAGES_PER_BLOCK = 8;
+constexpr u32 BLOCK_COUNT = NAND_PAGE_COUNT / PAGES_PER_BLOCK;
+constexpr size_t BLOCK_SIZE = PAGES_PER_BLOCK * NAND_PAGE_SIZE;
+
+class RamStorage final : public Storage {
+public:
+  RamStorage() : m_blocks{std::make_unique<std::atomic<u8*>[]>(BLOCK_COUNT)} {}
+
+  ~RamStorage() override {
+    for (u32 i = 0; i < BLOCK_COUNT; ++i)
+      delete[] m_blocks[i].load(std::memory_order_relaxed);
+  }
+
+  ResultCode ReadPages(u32 first_page, u32 count, u8* data) override {
+    if (first_page >= NAND_PAGE_COUNT || count > NAND_PAGE_COUNT - first_page)
+      return ResultCode::Invalid;
+
+    ForEachBlock(first_page, count, [&](u32 block, size_t offset, size_t size) {
+      const u8* ptr = m_blocks[block].load(std::memory_order_acquire);
+      if (ptr)
+        std::memcpy(data, ptr + offset, size);
+      else
+        std::memset(data, 0xff, size);
+      data += size;
+    });
+    return ResultCode::Success;
+  }
+
+  ResultCode WritePages(u32 first_page, u32 count, const u8* data) override {
+    if (first_page >= NAND_PAGE_COUNT || count > NAND_PAGE_COUNT - first_page)
+      return ResultCode::Invalid;
+
+    ForEachBlock(first_page, count, [&](u32 block, size_t offset, size_t size) {
+      std::memcpy(GetOrAllocateBlock(block) + offset, data, size);
+      data += size;
+    });
+    return ResultCode::Success;
+  }
+
+  ResultCode Flush(const std::vector<PageRange>& ranges) override {
+    return ResultCode::Success;
+  }
+
+  ResultCode Discard(const std::vector<PageRange>& ranges) override {
+    for (const PageRange& range : ranges) {
+      if (range.first_page >= NAND_PAGE_COUNT || range.count > NAND_PAGE_COUNT - range.first_page)
+        return ResultCode::Invalid;
+
+      ForEachBlock(range.first_page, range.count, [&](u32 block, size_t offset, size_t size) {
+        if (size == BLOCK_SIZE) {
+          delete[] m_blocks[block].exchange(nullptr, std::memory_order_acq_rel);
+          return;
+        }
+        if (u8* ptr = m_blocks[block].load(std::memory_order_acquire))
+          std::memset(ptr + offset, 0xff, size);
+      });
+    }
+    return ResultCode::Success;
+  }
+
+  bool CanDiscard() const override { return true; }
+
+private:
+  /// Call fn(block, offset in block, size) for each block that the page range touches.
+  template <typename Fn>
+  static void ForEachBlock(u32 first_page, u32 count, Fn fn) {
+    for (u32 page = first_page; page < first_page + count;) {
+      const u32 block = page / PAGES_PER_BLOCK;
+      const u32 page_in_block = page % PAGES_PER_BLOCK;
+      const u32 num_pages = std::min(PAGES_PER_BLOCK - page_in_block, first_page + count - page);
+      fn(block, size_t(page_in_block) * NAND_PAGE_SIZE, size_t(num_pages) * NAND_PAGE_SIZE);
+      page += num_pages;
+    }
+  }
+
+  u8* GetOrAllocateBlock(u32 block) {
+    u8* ptr = m_blocks[block].load(std::memory_order_acquire);
+    if (ptr)
+      return ptr;
+
+    // Writes to different pages of the same block may race to allocate it.
+    auto new_block = std::make_unique<u8[]>(BLOCK_SIZE);
+    std::memset(new_block.get(), 0xff, BLOCK_SIZE);
+    if (m_blocks[block].compare_exchange_strong(ptr, new_block.get(), std::memory_order_acq_rel))
+      return new_block.release();
+    return ptr;
+  }
+
+  std::unique_ptr<std::atomic<u8*>[]> m_blocks;
+};
+
+}  // namespace
+
+std::unique_ptr<Storage> Storage::CreateInMemory() {
+  return std::make_unique<RamStorage>();
+}
+
+}  // namespace wiifs
@@ -0,0 +1,418 @@
+// wiifs
+// Copyright 2018 leoetlino
+// Licensed under GPLv2+
+
+// Benchmark the hot paths of the driver: wiifs_bench [--filter <text>] [--min-time <seconds>]
+// Every benchmark runs against images that are generated in memory. Results are written to
+// stdout as JSON; progress goes to stderr. Only benchmarks whose name contains the filter run.
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "common/crypto.h"
+#include "common/ecc.h"
+#include "wiifs/fs.h"
+#include "wiifs/storage.h"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+constexpr std::uint32_t CLUSTER_SIZE = 0x4000;
+constexpr std::uint32_t FILE_SIZE = 4 * 1024 * 1024;
+constexpr std::uint32_t CHUNK_SIZE = 64 * 1024;
+constexpr std::uint32_t RANDOM_IO_SIZE = 4096;
+constexpr wiifs::FileMode RW = wiifs::FileMode(3);
+
+/// Accumulates the time spent in the measured part of a benchmark iteration.
+class Stopwatch {
+public:
+  void Start() { m_start = Clock::now(); }
+  void Stop() { m_elapsed += Clock::now() - m_start; }
+  Clock::duration GetElapsed() const { return m_elapsed; }
+
+private:
+  Clock::time_point m_start;
+  Clock::duration m_elapsed{};
+};
+
+/// Runs one iteration. Returns false if the operation failed.
+using BenchmarkFunction = std::function<bool(Stopwatch& stopwatch)>;
+
+struct BenchmarkResult {
+  std::string name;
+  std::uint64_t iterations = 0;
+  double ns_per_op = 0;
+  std::uint64_t bytes_per_op = 0;
+  bool failed = false;
+};
+
+struct BenchmarkOptions {
+  std::string filter;
+  double min_time = 0.5;
+};
+
+class BenchmarkRunner {
+public:
+  explicit BenchmarkRunner(const BenchmarkOptions& options) : m_options{options} {}
+
+  bool ShouldRun(const std::string& name) const {
+    return name.find(m_options.filter) != std::string::npos;
+  }
+
+  /// Run a benchmark for at least the minimum time (and at least once).
+  void Run(const std::string& name, std::uint64_t bytes_per_op, const BenchmarkFunction& fn) {
+    if (!ShouldRun(name))
+      return;
+
+    std::fprintf(stderr, "%s...\n", name.c_str());
+    BenchmarkResult result;
+    result.name = name;
+    result.bytes_per_op = bytes_per_op;
+    Stopwatch stopwatch;
+    const auto min_time = std::chrono::duration<double>(m_options.min_time);
+    const Clock::time_point start = Clock::now();
+    do {
+      if (!fn(stopwatch)) {
+        result.failed = true;
+        break;
+      }
+      ++result.iterations;
+    } while (Clock::now() - start < min_time);
+
+    if (result.iterations != 0) {
+      const std::chrono::duration<double, std::nano> elapsed = stopwatch.GetElapsed();
+      result.ns_per_op = elapsed.count() / result.iterations;
+    }
+    m_results.push_back(result);
+  }
+
+  void PrintJson() const {
+    std::printf("{\n  \"context\": {\n");
+    std::printf("    \"min_time\": %g,\n", m_options.min_time);
+    std::printf("    \"hardware_threads\": %u\n", std::thread::hardware_concurrency());
+    std::printf("  },\n  \"benchmarks\": [\n");
+    for (size_t i = 0; i < m_results.size(); ++i) {
+      const BenchmarkResult& result = m_results[i];
+      std::printf("    {\"name\": \"%s\", \"iterations\": %llu, \"ns_per_op\": %.1f",
+                  result.name.c_str(), static_cast<unsigned long long>(result.iterations),
+                  result.ns_per_op);
+      if (result.bytes_per_op != 0 && result.ns_per_op > 0) {
+        std::printf(", \"bytes_per_second\": %.0f",
+                    result.bytes_per_op * 1e9 / result.ns_per_op);
+      }
+      if (result.failed)
+        std::printf(", \"error\": true");
+      std::printf("}%s\n", i + 1 == m_results.size() ? "" : ",");
+    }
+    std::printf("  ]\n}\n");
+  }
+
+  bool HasFailures() const {
+    return std::any_of(m_results.begin(), m_results.end(),
+                       [](const BenchmarkResult& result) { return result.failed; });
+  }
+
+private:
+  BenchmarkOptions m_options;
+  std::vector<BenchmarkResult> m_results;
+};
+
+wiifs::FileSystemKeys GetKeys() {
+  wiifs::FileSystemKeys keys;
+  for (size_t i = 0; i < keys.hmac.size(); ++i)
+    keys.hmac[i] = static_cast<std::uint8_t>(0x11 * i + 1);
+  for (size_t i = 0; i < keys.aes.size(); ++i)
+    keys.aes[i] = static_cast<std::uint8_t>(0x25 * i + 7);
+  return keys;
+}
+
+/// Lets several file systems be mounted on the same storage (one after the other).
+class SharedStorage final : public wiifs::Storage {
+public:
+  explicit SharedStorage(wiifs::Storage& storage) : m_storage{storage} {}
+
+  wiifs::ResultCode ReadPages(std::uint32_t first_page, std::uint32_t count,
+                              std::uint8_t* data) override {
+    return m_storage.ReadPages(first_page, count, data);
+  }
+  wiifs::ResultCode WritePages(std::uint32_t first_page, std::uint32_t count,
+                               const std::uint8_t* data) override {
+    return m_storage.WritePages(first_page, count, data);
+  }
+  wiifs::ResultCode Flush(const std::vector<wiifs::PageRange>& ranges) override {
+    return m_storage.Flush(ranges);
+  }
+
+private:
+  wiifs::Storage& m_storage;
+};
+
+/// A freshly formatted file system in memory.
+struct Image {
+  Image() : storage{wiifs::Storage::CreateInMemory()} {
+    fs = wiifs::FileSystem::Create(std::make_unique<SharedStorage>(*storage), GetKeys());
+    if (fs->Format(0) != wiifs::ResultCode::Success)
+      std::abort();
+    fd = *fs->OpenFs(0, 0);
+  }
+
+  std::unique_ptr<wiifs::Storage> storage;
+  std::unique_ptr<wiifs::FileSystem> fs;
+  wiifs::Fd fd;
+};
+
+void RunKernelBenchmarks(BenchmarkRunner& runner) {
+  std::vector<std::uint8_t> data(CLUSTER_SIZE);
+  std::mt19937 random{1};
+  std::generate(data.begin(), data.end(), [&] { return std::uint8_t(random()); });
+  const wiifs::FileSystemKeys keys = GetKeys();
+
+  runner.Run("kernel/ecc_calculate_page", 0x800, [&](Stopwatch& stopwatch) {
+    stopwatch.Start();
+    static_cast<void>(ecc::Calculate(data.data()));
+    stopwatch.Stop();
+    return true;
+  });
+
+  std::vector<std::uint8_t> output(CLUSTER_SIZE);
+  runner.Run("kernel/aes_encrypt_cluster", CLUSTER_SIZE, [&](Stopwatch& stopwatch) {
+    std::array<std::uint8_t, 16> iv{};
+    stopwatch.Start();
+    crypto::AesEncrypt(keys.aes.data(), iv.data(), data.data(), output.data(), CLUSTER_SIZE);
+    stopwatch.Stop();
+    return true;
+  });
+  runner.Run("kernel/aes_decrypt_cluster", CLUSTER_SIZE, [&](Stopwatch& stopwatch) {
+    std::array<std::uint8_t, 16> iv{};
+    stopwatch.Start();
+    crypto::AesDecrypt(keys.aes.data(), iv.data(), data.data(), output.data(), CLUSTER_SIZE);
+    stopwatch.Stop();
+    return true;
+  });
+
+  runner.Run("kernel/hmac_cluster", CLUSTER_SIZE, [&](Stopwatch& stopwatch) {
+    // Data clusters are hashed together with a 0x40-byte salt.
+    const std::array<std::uint8_t, 0x40> salt{};
+    stopwatch.Start();
+    crypto::BlockMacGenerator generator{keys.hmac};
+    generator.Update(salt.data(), salt.size());
+    generator.Update(data.data(), data.size());
+    static_cast<void>(generator.FinaliseAndGetHash());
+    stopwatch.Stop();
+    return true;
+  });
+}
+
+void RunMetadataBenchmarks(BenchmarkRunner& runner) {
+  for (const std::uint32_t directory_size : {1, 64, 512}) {
+    const std::string suffix = "/" + std::to_string(directory_size);
+    const auto should_run = [&](const char* operation) {
+      return runner.ShouldRun(std::string("metadata/") + operation + suffix);
+    };
+    if (!should_run("create") && !should_run("lookup") && !should_run("delete") &&
+        !should_run("rename")) {
+      continue;
+    }
+
+    // Benchmarks leave the directory with `directory_size` entries after each iteration.
+    Image image;
+    wiifs::FileSystem& fs = *image.fs;
+    if (fs.CreateDirectory(image.fd, "/dir", 0, RW, RW, RW) != wiifs::ResultCode::Success)
+      std::abort();
+    for (std::uint32_t i = 0; i < directory_size; ++i) {
+      if (fs.CreateFile(image.fd, "/dir/f" + std::to_string(i), 0, RW, RW, RW) !=
+          wiifs::ResultCode::Success) {
+        std::abort();
+      }
+    }
+
+    runner.Run("metadata/create" + suffix, 0, [&](Stopwatch& stopwatch) {
+      stopwatch.Start();
+      const auto result = fs.CreateFile(image.fd, "/dir/new", 0, RW, RW, RW);
+      stopwatch.Stop();
+      return result == wiifs::ResultCode::Success &&
+             fs.Delete(image.fd, "/dir/new") == wiifs::ResultCode::Success;
+    });
+
+    // The first file that was created is at the end of the directory's entry list.
+    runner.Run("metadata/lookup" + suffix, 0, [&](Stopwatch& stopwatch) {
+      stopwatch.Start();
+      const auto result = fs.GetMetadata(image.fd, "/dir/f0");
+      stopwatch.Stop();
+      return result.Succeeded();
+    });
+
+    runner.Run("metadata/delete" + suffix, 0, [&](Stopwatch& stopwatch) {
+      if (fs.CreateFile(image.fd, "/dir/new", 0, RW, RW, RW) != wiifs::ResultCode::Success)
+        return false;
+      stopwatch.Start();
+      const auto result = fs.Delete(image.fd, "/dir/new");
+      stopwatch.Stop();
+      return result == wiifs::ResultCode::Success;
+    });
+
+    bool renamed = false;
+    runner.Run("metadata/rename" + suffix, 0, [&](Stopwatch& stopwatch) {
+      const char* from = renamed ? "/dir/renamed" : "/dir/f0";
+      const char* to = renamed ? "/dir/f0" : "/dir/renamed";
+      stopwatch.Start();
+      const auto result = fs.Rename(image.fd, from, to);
+      stopwatch.Stop();
+      renamed = !renamed;
+      return result == wiifs::ResultCode::Success;
+    });
+  }
+}
+
+void RunFileBenchmarks(BenchmarkRunner& runner) {
+  if (!runner.ShouldRun("io/"))
+    return;
+
+  Image image;
+  wiifs::FileSystem& fs = *image.fs;
+  std::vector<std::uint8_t> data(FILE_SIZE);
+  std::mt19937 random{2};
+  std::generate(data.begin(), data.end(), [&] { return std::uint8_t(random()); });
+
+  runner.Run("io/sequential_write", FILE_SIZE, [&](Stopwatch& stopwatch) {
+    if (fs.CreateFile(image.fd, "/seq", 0, RW, RW, RW) != wiifs::ResultCode::Success)
+      return false;
+    const auto fd = fs.OpenFile(0, 0, "/seq", RW);
+    if (!fd)
+      return false;
+    bool ok = true;
+    stopwatch.Start();
+    for (std::uint32_t offset = 0; offset < FILE_SIZE && ok; offset += CHUNK_SIZE)
+      ok = fs.WriteFile(*fd, &data[offset], CHUNK_SIZE).Succeeded();
+    ok = fs.Close(*fd) == wiifs::ResultCode::Success && ok;
+    stopwatch.Stop();
+    return ok && fs.Delete(image.fd, "/seq") == wiifs::ResultCode::Success;
+  });
+
+  // The remaining benchmarks use a single file that is written once.
+  if (fs.CreateFile(image.fd, "/file", 0, RW, RW, RW) != wiifs::ResultCode::Success)
+    std::abort();
+  const auto fd = fs.OpenFile(0, 0, "/file", RW);
+  if (!fd || !fs.WriteFile(*fd, data.data(), FILE_SIZE) ||
+      fs.Close(*fd) != wiifs::ResultCode::Success) {
+    std::abort();
+  }
+  const auto file = fs.OpenFile(0, 0, "/file", RW);
+  if (!file)
+    std::abort();
+
+  std::vector<std::uint8_t> buffer(FILE_SIZE);
+  runner.Run("io/sequential_read", FILE_SIZE, [&](Stopwatch& stopwatch) {
+    bool ok = true;
+    stopwatch.Start();
+    for (std::uint32_t offset = 0; offset < FILE_SIZE && ok; offset += CHUNK_SIZE)
+      ok = fs.ReadFileAt(*file, offset, &buffer[offset], CHUNK_SIZE).Succeeded();
+    stopwatch.Stop();
+    return ok && std::memcmp(buffer.data(), data.data(), FILE_SIZE) == 0;
+  });
+
+  std::uniform_int_distribution<std::uint32_t> offsets{0, FILE_SIZE / RANDOM_IO_SIZE - 1};
+  runner.Run("io/random_read_4k", RANDOM_IO_SIZE, [&](Stopwatch& stopwatch) {
+    const std::uint32_t offset = offsets(random) * RANDOM_IO_SIZE;
+    stopwatch.Start();
+    const auto result = fs.ReadFileAt(*file, offset, buffer.data(), RANDOM_IO_SIZE);
+    stopwatch.Stop();
+    return result && *result == RANDOM_IO_SIZE;
+  });
+
+  runner.Run("io/random_write_4k", RANDOM_IO_SIZE, [&](Stopwatch& stopwatch) {
+    const std::uint32_t offset = offsets(random) * RANDOM_IO_SIZE;
+    stopwatch.Start();
+    const auto result = fs.WriteFileAt(*file, offset, &data[offset], RANDOM_IO_SIZE);
+    stopwatch.Stop();
+    return result && *result == RANDOM_IO_SIZE;
+  });
+
+  fs.Close(*file);
+}
+
+void RunFileSystemBenchmarks(BenchmarkRunner& runner) {
+  if (!runner.ShouldRun("fs/"))
+    return;
+
+  // A populated image, so that mounting and statistics have some work to do.
+  Image image;
+  wiifs::FileSystem& fs = *image.fs;
+  const std::vector<std::uint8_t> data(3 * CLUSTER_SIZE, 0x5a);
+  for (std::uint32_t i = 0; i < 256; ++i) {
+    const std::string path = "/f" + std::to_string(i);
+    if (fs.CreateFile(image.fd, path, 0, RW, RW, RW) != wiifs::ResultCode::Success)
+      std::abort();
+    const auto fd = fs.OpenFile(0, 0, path, RW);
+    if (!fd || !fs.WriteFile(*fd, data.data(), data.size()) ||
+        fs.Close(*fd) != wiifs::ResultCode::Success) {
+      std::abort();
+    }
+  }
+
+  // A metadata change that does nothing but flush the superblock.
+  // (Metadata can only be changed for empty files.)
+  if (fs.CreateFile(image.fd, "/empty", 0, RW, RW, RW) != wiifs::ResultCode::Success)
+    std::abort();
+  runner.Run("fs/flush_superblock", 0, [&](Stopwatch& stopwatch) {
+    stopwatch.Start();
+    const auto result = fs.SetMetadata(image.fd, "/empty", 0, 0, 0, RW, RW, RW);
+    stopwatch.Stop();
+    return result == wiifs::ResultCode::Success;
+  });
+
+  runner.Run("fs/get_nand_stats", 0, [&](Stopwatch& stopwatch) {
+    stopwatch.Start();
+    const auto result = fs.GetNandStats(image.fd);
+    stopwatch.Stop();
+    return result.Succeeded();
+  });
+
+  // The superblock is only loaded (and verified) by the first call that needs it.
+  runner.Run("fs/mount", 0, [&](Stopwatch& stopwatch) {
+    stopwatch.Start();
+    const auto mounted =
+        wiifs::FileSystem::Create(std::make_unique<SharedStorage>(*image.storage), GetKeys());
+    const auto fd = mounted->OpenFs(0, 0);
+    const bool ok = fd && mounted->GetMetadata(*fd, "/f0").Succeeded();
+    stopwatch.Stop();
+    return ok;
+  });
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  BenchmarkOptions options;
+  for (int i = 1; i < argc; ++i) {
+    const std::string arg = argv[i];
+    if (arg == "--filter" && i + 1 < argc) {
+      options.filter = argv[++i];
+    } else if (arg == "--min-time" && i + 1 < argc) {
+      options.min_time = std::atof(argv[++i]);
+    } else {
+      std::fprintf(stderr, "Usage: %s [--filter <text>] [--min-time <seconds>]\n", argv[0]);
+      return 2;
+    }
+  }
+
+  BenchmarkRunner runner{options};
+  RunKernelBenchmarks(runner);
+  RunMetadataBenchmarks(runner);
+  RunFileBenchmarks(runner);
+  RunFileSystemBenchmarks(runner);
+  runner.PrintJson();
+  return runner.HasFailures() ? 1 : 0;
+}
@@ -0,0 +1,108 @@
+// wiifs
+// Copyright 2018 leoetlino
+// Licensed under GPLv2+
+
+// Generate a synthetic NAND image: wiifs_gen <nand.bin> <hmac key> <aes key> [options]
+// Keys are given in hex. The image is created if it does not exist and formatted otherwise.
+// Options: --seed <n>, --fill <0-1>, --titles <n>, --channels <0-1>, --fragmentation <0-1>,
+// --sparse (store erased pages as holes; the image must then be opened as a sparse file)
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "tools/parse_key.h"
+#include "wiifs/fs.h"
+#include "wiifs/generator.h"
+
+static bool ParseOptions(int argc, char** argv, wiifs::GeneratorOptions* options, bool* sparse) {
+  for (int i = 4; i < argc; ++i) {
+    const std::string arg = argv[i];
+    if (arg == "--sparse") {
+      *sparse = true;
+      continue;
+    }
+    if (i + 1 >= argc)
+      return false;
+    const char* value = argv[++i];
+    if (arg == "--seed")
+      options->seed = std::strtoull(value, nullptr, 0);
+    else if (arg == "--fill")
+      options->fill_level = std::atof(value);
+    else if (arg == "--titles")
+      options->max_titles = static_cast<std::uint32_t>(std::strtoul(value, nullptr, 0));
+    else if (arg == "--channels")
+      options->channel_ratio = std::atof(value);
+    else if (arg == "--fragmentation")
+      options->fragmentation = std::atof(value);
+    else
+      return false;
+  }
+  return true;
+}
+
+/// Erase the whole NAND, so that the image does not depend on what the file contained before
+/// and unused pages read back as 0xff like on a real console.
+static wiifs::ResultCode EraseNand(wiifs::Storage& storage, bool sparse) {
+  if (sparse)
+    return storage.Discard({{0, wiifs::NAND_PAGE_COUNT}});
+  constexpr std::uint32_t PAGES_PER_WRITE = 0x400;
+  const std::vector<std::uint8_t> erased(PAGES_PER_WRITE * wiifs::NAND_PAGE_SIZE, 0xff);
+  for (std::uint32_t page = 0; page < wiifs::NAND_PAGE_COUNT; page += PAGES_PER_WRITE) {
+    const auto result = storage.WritePages(page, PAGES_PER_WRITE, erased.data());
+    if (result != wiifs::ResultCode::Success)
+      return result;
+  }
+  return wiifs::ResultCode::Success;
+}
+
+int main(int argc, char** argv) {
+  wiifs::FileSystemKeys keys;
+  wiifs::GeneratorOptions options;
+  bool sparse = false;
+  if (argc < 4 || !ParseKey(argv[2], &keys.hmac) || !ParseKey(argv[3], &keys.aes) ||
+      !ParseOptions(argc, argv, &options, &sparse)) {
+    std::fprintf(stderr,
+                 "Usage: %s <nand.bin> <hmac key (hex)> <aes key (hex)> [--seed <n>] "
+                 "[--fill <0-1>] [--titles <n>] [--channels <0-1>] [--fragmentation <0-1>] "
+                 "[--sparse]\n",
+                 argv[0]);
+    return 2;
+  }
+
+  wiifs::FileStorageOptions storage_options;
+  storage_options.create = true;
+  storage_options.sparse = sparse;
+  auto storage = wiifs::Storage::OpenFile(argv[1], storage_options);
+  if (!storage) {
+    std::fprintf(stderr, "Failed to open %s\n", argv[1]);
+    return 2;
+  }
+  if (EraseNand(**storage, sparse) != wiifs::ResultCode::Success) {
+    std::fprintf(stderr, "Failed to erase %s\n", argv[1]);
+    return 1;
+  }
+
+  const auto fs = wiifs::FileSystem::Create(std::move(*storage), keys,
+                                            wiifs::GetGeneratorFileSystemOptions());
+  const auto report = wiifs::GenerateImage(*fs, options);
+  if (!report) {
+    std::fprintf(stderr, "Generation failed (error %d)\n", static_cast<int>(report.Error()));
+    return 1;
+  }
+
+  const double mib = report->bytes_written / 1048576.0;
+  std::printf("Generated %u titles, %u files and %u directories in %.2f s\n", report->titles,
+              report->files, report->directories, report->elapsed_seconds);
+  std::printf("Data: %.1f MiB (%.1f MiB/s)\n", mib,
+              report->elapsed_seconds > 0 ? mib / report->elapsed_seconds : 0.0);
+  const wiifs::NandStats& stats = report->nand_stats;
+  std::printf("Clusters: %u used, %u free; inodes: %u used, %u free\n", stats.used_clusters,
+              stats.free_clusters, stats.used_inodes, stats.free_inodes);
+  std::printf("Fragmented files: %u/%u (%u extents)\n", report->fragmentation.fragmented_files,
+              report->fragmentation.files, report->fragmentation.extents);
+  return 0;
+}
@@ -0,0 +1,28 @@
+// wiifs
+// Copyright 2018 leoetlino
+// Licensed under GPLv2+
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+
+/// Parse a key given in hex on the command line. Returns false if the string does not contain
+/// exactly N bytes.
+template <std::size_t N>
+bool ParseKey(const char* hex, std::array<std::uint8_t, N>* key) {
+  const std::string string{hex};
+  if (string.size() != 2 * N)
+    return false;
+  for (std::size_t i = 0; i < N; ++i) {
+    char* end;
+    const std::string byte = string.substr(2 * i, 2);
+    (*key)[i] = static_cast<std::uint8_t>(std::strtoul(byte.c_str(), &end, 16));
+    if (*end != '\0')
+      return false;
+  }
+  return true;
+}
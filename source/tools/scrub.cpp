@@ -0,0 +1,79 @@
+// wiifs
+// Copyright 2018 leoetlino
+// Licensed under GPLv2+
+
+// Check the integrity of a NAND image: wiifs_scrub <nand.bin> <hmac key> <aes key>
+// Keys are given in hex. The exit code is 0 if no errors were found and 1 otherwise.
+
+#include <cstdint>
+#include <cstdio>
+#include <utility>
+
+#include "tools/parse_key.h"
+#include "wiifs/fs.h"
+
+static const char* GetErrorName(wiifs::ResultCode code) {
+  switch (code) {
+  case wiifs::ResultCode::CriticalEccError:
+    return "uncorrectable ECC error";
+  case wiifs::ResultCode::CheckFailed:
+    return "HMAC mismatch";
+  case wiifs::ResultCode::Invalid:
+    return "broken cluster chain";
+  default:
+    return "read error";
+  }
+}
+
+int main(int argc, char** argv) {
+  wiifs::FileSystemKeys keys;
+  if (argc != 4 || !ParseKey(argv[2], &keys.hmac) || !ParseKey(argv[3], &keys.aes)) {
+    std::fprintf(stderr, "Usage: %s <nand.bin> <hmac key (hex)> <aes key (hex)>\n", argv[0]);
+    return 2;
+  }
+
+  wiifs::FileStorageOptions options;
+  options.read_only = true;
+  auto storage = wiifs::Storage::OpenFile(argv[1], options);
+  if (!storage) {
+    std::fprintf(stderr, "Failed to open %s\n", argv[1]);
+    return 2;
+  }
+
+  const auto fs = wiifs::FileSystem::CreateReadOnly(std::move(*storage), keys);
+  const auto fd = fs->OpenFs(0, 0);
+  if (!fd) {
+    std::fprintf(stderr, "Failed to open the file system (error %d)\n",
+                 static_cast<int>(fd.Error()));
+    return 2;
+  }
+  const auto report = fs->Scrub(*fd, [](std::uint32_t done, std::uint32_t total) {
+    std::fprintf(stderr, "\r%u/%u clusters", done, total);
+  });
+  std::fprintf(stderr, "\n");
+  if (!report) {
+    std::fprintf(stderr, "Scrub failed (error %d)\n", static_cast<int>(report.Error()));
+    return 2;
+  }
+
+  for (const wiifs::ScrubError& error : report->errors) {
+    if (error.fst_index == 0xffff) {
+      std::printf("cluster 0x%04x: %s (superblock %u)\n", error.cluster, GetErrorName(error.error),
+                  error.superblock_slot);
+    } else {
+      std::printf("cluster 0x%04x: %s (%s, cluster %u)\n", error.cluster,
+                  GetErrorName(error.error), error.path.c_str(), error.chain_index);
+    }
+  }
+
+  const double mib = report->bytes_read / 1048576.0;
+  std::printf("Checked %u clusters (%.1f MiB) in %.2f s (%.1f MiB/s)\n", report->checked_clusters,
+              mib, report->elapsed_seconds,
+              report->elapsed_seconds > 0 ? mib / report->elapsed_seconds : 0.0);
+  std::printf("Superblocks: %u valid, %u empty\n", report->valid_superblocks,
+              report->empty_superblocks);
+  std::printf("ECC-corrected bits: %u\n", report->ecc_corrected_bits);
+  std::printf("Single HMAC copy mismatches: %u\n", report->hmac_copy_mismatches);
+  std::printf("Errors: %zu\n", report->errors.size());
+  return report->errors.empty() ? 0 : 1;
+}